@@ -3,6 +3,13 @@
 #include <netcdf.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #include <Rdefines.h>
 #include <R_ext/Rdynload.h>
@@ -28,18 +35,18 @@
 
 void R_nc4_inq_varid_hier( int *ncid, char **varname, int *returned_grpid, int *returned_varid );
 int  R_nc4_nctype_to_Rtypecode( nc_type nct );
-void R_nc4_varsize( int *ncid, int *varid, int *ndims, int *varsize, int *retval );
+void R_nc4_varsize( int *ncid, int *varid, int *ndims, double *varsize, int *retval );
 void R_nc4_inq_varunlim( int *ncid, int *varid, int *isunlim, int *retval );
 void R_nc4_inq_var( int *ncid, int *varid, char **varname, int *type, int *ndims, int *dimids, int *natts, int *precint, int *retval );
 void R_nc4_inq_vartype( int *ncid, int *varid, int *precint, int *retval );
 void R_nc4_inq_varname( int *ncid, int *varid, char **varname, int *retval );
 void R_nc4_inq_varndims( int *ncid, int *varid, int *ndims, int *retval );
-void R_nc4_inq_dimlen( int *ncid, char **dimname, int *dimlen );
+void R_nc4_inq_dimlen( int *ncid, char **dimname, double *dimlen );
 void R_nc4_inq_dimid( int *ncid, char **dimname, int *dimid );
 void R_nc4_inq_varid( int *ncid, char **varname, int *varid );
 void R_nc4_inq_unlimdim( int *ncid, int *unlimdimid, int *retval );
 void R_nc4_inq_dimids( int *ncid, int *dimids, int *retval );
-void R_nc4_inq_dim( int *ncid, int *dimid, char **dimname, int *dimlen, int *unlim, int *retval );
+void R_nc4_inq_dim( int *ncid, int *dimid, char **dimname, double *dimlen, int *unlim, int *retval );
 void R_nc4_inq( int *ncid, int *ndims, int *nvars, int *natts, int *retval );
 void R_nc4_open( char **filename, int *cmode, int *ncid, int *retval );
 void R_nc4_create( char **filename, int *cmode, int *ncid, int *retval );
@@ -63,7 +70,7 @@ void R_nc4_def_var_float ( int *ncid, char **varname, int *ndims, int *dimids, i
 void R_nc4_def_var_double( int *ncid, char **varname, int *ndims, int *dimids, int *varid, int *retval );
 void R_nc4_def_var_char  ( int *ncid, char **varname, int *ndims, int *dimids, int *varid, int *retval );
 
-void R_nc4_def_dim( int *ncid, char **dimname, int *size, int *dimid, int *retval );
+void R_nc4_def_dim( int *ncid, char **dimname, double *size, int *dimid, int *retval );
 void R_nc4_redef( int *ncid );
 void R_nc4_rename_var( int *ncid, int *varid, char **newname, int *retval );
 void R_nc4_inq_attname( int *ncid, int *varid, int *attnum, char **attname, int *retval );
@@ -78,8 +85,8 @@ void R_nc4_inq_groupids( int *root_id, int *gids, int *ierr );
 int R_nc4_util_nslashes( char *s, int *idx_first_slash );
 void R_nc4_inq_varid_hier_inner( int *ncid, char *varname, int *returned_grpid, int *returned_varid );
 void R_nc4_inq_varid_hier( int *ncid, char **varname, int *returned_grpid, int *returned_varid );
-void R_nc4_get_vara_text( int *ncid, int *varid, int *start, int *count, char **tempstore, char **data, int *retval );
-void R_nc4_put_vara_text( int *ncid, int *varid, int *start, int *count, char **data, int *retval );
+void R_nc4_get_vara_text( int *ncid, int *varid, double *start, double *count, char **tempstore, char **data, int *retval );
+void R_nc4_put_vara_text( int *ncid, int *varid, double *start, double *count, char **data, int *retval );
 
 void R_nc4_enddef( int *ncid, int *retval );
 void R_nc4_sync  ( int *ncid );
@@ -91,7 +98,10 @@ void R_ncu4_calc_start_count( int ncid, int varid, int *start_arg, int len_start
 	int *count_arg, int len_count, size_t *varsize,
 	int ndims, size_t *start, size_t *count );
 int R_ncu4_get_varsize( int ncid, int varid, int ndims, size_t *varsize );
+static size_t R_ncu4_sizet_elt( SEXP sx_v, int i );
 int R_ncu4_isdimvar( int ncid, char *name );
+void R_ncu4_hier_flush( int ncid );
+void R_nc4_inq_dimid_hier( int *ncid, char **dimname, int *returned_grpid, int *returned_dimid );
 
 SEXP Rsx_nc4_get_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP sx_count, SEXP sx_fixmiss, SEXP sx_imvstate, SEXP sx_missval );
 SEXP Rsx_nc4_get_vara_int   ( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP sx_count, SEXP sx_byte_style );
@@ -109,6 +119,62 @@ SEXP R_ncu4_getListElement(SEXP list, char *str);
 SEXP R_nc4_get_vara_string( SEXP sx_nc, SEXP sx_varid, SEXP sx_start, SEXP sx_count );
 
 SEXP R_nc4_inq_libvers( void );
+SEXP R_nc4_decode_time( SEXP sx_vals, SEXP sx_calcode, SEXP sx_unitsec, SEXP sx_origin );
+SEXP R_nc4_encode_time( SEXP sx_comp, SEXP sx_calcode, SEXP sx_unitsec, SEXP sx_origin );
+SEXP R_nc4_coord_index( SEXP sx_vals );
+SEXP R_nc4_coord_range( SEXP sx_vals, SEXP sx_info, SEXP sx_lo, SEXP sx_hi );
+SEXP R_nc4_kdtree_build( SEXP sx_lat, SEXP sx_lon );
+SEXP R_nc4_kdtree_query( SEXP sx_tree, SEXP sx_lat, SEXP sx_lon );
+SEXP R_nc4_get_points_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_pdims, SEXP sx_pidx, SEXP sx_imvstate, SEXP sx_missval );
+SEXP R_nc4_reduce_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_reduce, SEXP sx_block, SEXP sx_want, SEXP sx_imvstate, SEXP sx_missval,
+	SEXP sx_scale, SEXP sx_offset, SEXP sx_gdim, SEXP sx_groups, SEXP sx_ngroups );
+SEXP R_nc4_stream_stats_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_block, SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset, 
+	SEXP sx_breaks, SEXP sx_compression );
+SEXP R_nc4_tdigest_merge( SEXP sx_mean, SEXP sx_weight, SEXP sx_compression );
+SEXP R_nc4_tdigest_quantile( SEXP sx_mean, SEXP sx_weight, SEXP sx_min, SEXP sx_max, SEXP sx_probs );
+SEXP R_nc4_chunk_stats_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_block, SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset );
+SEXP R_nc4_where_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_bstart, SEXP sx_bcount, 
+	SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset, SEXP sx_op, 
+	SEXP sx_lo, SEXP sx_hi );
+SEXP R_nc4_copy_global_atts( SEXP sx_in_gid, SEXP sx_out_gid );
+SEXP R_nc4_copy_var_def( SEXP sx_in_gid, SEXP sx_in_varid, SEXP sx_out_gid, SEXP sx_dimids, 
+	SEXP sx_chunks, SEXP sx_deflate, SEXP sx_shuffle );
+SEXP R_nc4_copy_vara( SEXP sx_in_gid, SEXP sx_in_varid, SEXP sx_out_gid, SEXP sx_out_varid, 
+	SEXP sx_in_start, SEXP sx_count, SEXP sx_out_start, SEXP sx_block );
+SEXP R_nc4_wbuf_put( SEXP sx_root, SEXP sx_gid, SEXP sx_varid, SEXP sx_start, SEXP sx_count,
+	SEXP sx_chunks, SEXP sx_dimlen, SEXP sx_vals, SEXP sx_maxbytes );
+SEXP R_nc4_wbuf_flush( SEXP sx_root );
+SEXP R_nc4_async_put( SEXP sx_root, SEXP sx_gid, SEXP sx_varid, SEXP sx_start, SEXP sx_count,
+	SEXP sx_vals, SEXP sx_maxqueue );
+SEXP R_nc4_async_wait( SEXP sx_root );
+SEXP R_nc4_iter_open( SEXP sx_gid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, SEXP sx_along,
+	SEXP sx_by, SEXP sx_nslot, SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset );
+SEXP R_nc4_iter_next( SEXP sx_iter );
+SEXP R_nc4_get_vara_par( SEXP sx_filename, SEXP sx_varname, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_isint, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_imvstate, SEXP sx_missval,
+	SEXP sx_split, SEXP sx_pstart, SEXP sx_pcount );
+SEXP R_nc4_get_vara_fast( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset, SEXP sx_dim );
+SEXP R_nc4_get_vara_into( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_buf, SEXP sx_boffset, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset );
+SEXP R_nc4_put_vara_pack( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_vals, SEXP sx_scale, SEXP sx_offset, SEXP sx_missval );
+SEXP R_nc4_get_vara_perm( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_ostr, SEXP sx_block, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset );
+SEXP R_nc4_get_vara_mask( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_nmask, SEXP sx_cells, SEXP sx_block, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset );
+SEXP R_nc4_get_vara_stack( SEXP sx_filenames, SEXP sx_varname, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_varsize, SEXP sx_precint, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset, SEXP sx_nworkers );
+
+static void R_ncu4_async_drain( void );
 
 /* For C calls that don't use SEXP type args */
 static const
@@ -166,6 +232,7 @@ R_CMethodDef cMethods[] = {
 	{"R_nc4_util_nslashes", 	(DL_FUNC) &R_nc4_util_nslashes,    	2},
 	{"R_nc4_inq_varid_hier_inner", 	(DL_FUNC) &R_nc4_inq_varid_hier_inner,  4},
 	{"R_nc4_inq_varid_hier", 	(DL_FUNC) &R_nc4_inq_varid_hier,  	4},
+	{"R_nc4_inq_dimid_hier", 	(DL_FUNC) &R_nc4_inq_dimid_hier,  	4},
 
 	{"R_nc4_get_vara_text", 	(DL_FUNC) &R_nc4_get_vara_text,  	7},
 	{"R_nc4_put_vara_text", 	(DL_FUNC) &R_nc4_put_vara_text,  	6},
@@ -202,6 +269,35 @@ R_CallMethodDef callMethods[] = {
 	{"R_nc4_get_vara_string", 	(DL_FUNC) &R_nc4_get_vara_string, 	4},
 
 	{"R_nc4_inq_libvers", 		(DL_FUNC) &R_nc4_inq_libvers,  		0},
+	{"R_nc4_decode_time", 		(DL_FUNC) &R_nc4_decode_time,  		4},
+	{"R_nc4_encode_time", 		(DL_FUNC) &R_nc4_encode_time,  		4},
+	{"R_nc4_coord_index", 		(DL_FUNC) &R_nc4_coord_index,  		1},
+	{"R_nc4_coord_range", 		(DL_FUNC) &R_nc4_coord_range,  		4},
+	{"R_nc4_kdtree_build", 		(DL_FUNC) &R_nc4_kdtree_build,  	2},
+	{"R_nc4_kdtree_query", 		(DL_FUNC) &R_nc4_kdtree_query,  	3},
+	{"R_nc4_get_points_double", 	(DL_FUNC) &R_nc4_get_points_double,  	9},
+	{"R_nc4_reduce_double", 	(DL_FUNC) &R_nc4_reduce_double,  	15},
+	{"R_nc4_stream_stats_double", 	(DL_FUNC) &R_nc4_stream_stats_double,  	12},
+	{"R_nc4_tdigest_merge", 	(DL_FUNC) &R_nc4_tdigest_merge,  	3},
+	{"R_nc4_tdigest_quantile", 	(DL_FUNC) &R_nc4_tdigest_quantile,  	5},
+	{"R_nc4_chunk_stats_double", 	(DL_FUNC) &R_nc4_chunk_stats_double,  	10},
+	{"R_nc4_where_double", 		(DL_FUNC) &R_nc4_where_double,  	12},
+	{"R_nc4_copy_global_atts", 	(DL_FUNC) &R_nc4_copy_global_atts,  	2},
+	{"R_nc4_copy_var_def", 		(DL_FUNC) &R_nc4_copy_var_def,  	7},
+	{"R_nc4_copy_vara", 		(DL_FUNC) &R_nc4_copy_vara,  	8},
+	{"R_nc4_wbuf_put", 		(DL_FUNC) &R_nc4_wbuf_put,  	9},
+	{"R_nc4_wbuf_flush", 		(DL_FUNC) &R_nc4_wbuf_flush,  	1},
+	{"R_nc4_async_put", 		(DL_FUNC) &R_nc4_async_put,  	7},
+	{"R_nc4_async_wait", 		(DL_FUNC) &R_nc4_async_wait,  	1},
+	{"R_nc4_iter_open", 		(DL_FUNC) &R_nc4_iter_open,  	12},
+	{"R_nc4_iter_next", 		(DL_FUNC) &R_nc4_iter_next,  	1},
+	{"R_nc4_get_vara_par", 		(DL_FUNC) &R_nc4_get_vara_par,  	12},
+	{"R_nc4_get_vara_fast", 	(DL_FUNC) &R_nc4_get_vara_fast,  	11},
+	{"R_nc4_get_vara_into", 	(DL_FUNC) &R_nc4_get_vara_into,  	12},
+	{"R_nc4_put_vara_pack", 	(DL_FUNC) &R_nc4_put_vara_pack,  	9},
+	{"R_nc4_get_vara_perm", 	(DL_FUNC) &R_nc4_get_vara_perm,  	12},
+	{"R_nc4_get_vara_mask", 	(DL_FUNC) &R_nc4_get_vara_mask,  	13},
+	{"R_nc4_get_vara_stack", 	(DL_FUNC) &R_nc4_get_vara_stack,  	12},
 
 	{NULL}
 };
@@ -257,7 +353,7 @@ int R_nc4_nctype_to_Rtypecode( nc_type nct )
 /* Returns a vector of dim sizes for the variable.
  * 'retval' is 0 for no error, or -1 for an error.
  */
-void R_nc4_varsize( int *ncid, int *varid, int *ndims, int *varsize, int *retval )
+void R_nc4_varsize( int *ncid, int *varid, int *ndims, double *varsize, int *retval )
 {
 	int 	i, err, dimid[NC_MAX_DIMS];
 	size_t	dimlen;
@@ -291,7 +387,7 @@ void R_nc4_varsize( int *ncid, int *varid, int *ndims, int *varsize, int *retval
 			*retval = -1;
 			return;
 			}
-		varsize[i] = (int)dimlen;
+		varsize[i] = (double)dimlen;
 		}
 }
 
@@ -403,7 +499,7 @@ SEXP Rsx_nc4_get_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP s
 	SEXP	sx_retval, sx_retnames, sx_reterr, sx_retdata;
 	int	ncid, varid, i, err, ndims, fixmiss, imvstate, scalar_var;
 	double	*p_data, missval, mvtol;
-	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], tot_size;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], tot_size, k;
 	char	vn[2048];
 
 	/* Make space for our returned list, which will have
@@ -447,7 +543,7 @@ SEXP Rsx_nc4_get_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP s
 	/* Sanity check -- number of start and count elements must
 	   match number of dims in the var
 	*/
-	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (INTEGER(sx_start)[0]==0) && (INTEGER(sx_count)[0]==1));
+	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (R_ncu4_sizet_elt(sx_start,0)==0) && (R_ncu4_sizet_elt(sx_count,0)==1));
 	if( (!scalar_var) && (ndims != GET_LENGTH(sx_start))) {
 		Rprintf( "Error in R_nc4_get_vara_double: I think var has %d dimensions, but passed start array is length %d. They must be the same!\n",
 			ndims, GET_LENGTH(sx_start) );
@@ -471,13 +567,24 @@ SEXP Rsx_nc4_get_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP s
 	 */
 	tot_size = 1L;
 	for( i=0; i<ndims; i++ ) {
-		s_start[i] = (size_t)(INTEGER(sx_start)[i]);
-		s_count[i] = (size_t)(INTEGER(sx_count)[i]);
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
 		tot_size *= s_count[i];
 		}
 		
-	/* Make space for the returned data */
-	PROTECT( sx_retdata = allocVector(REALSXP, tot_size));
+	/* Make space for the returned data.  This can be a long vector
+	 * (more than 2^31-1 elements), but not more than R can index.
+	 */
+	if( tot_size > (size_t)R_XLEN_T_MAX ) {
+		Rprintf( "Error in Rsx_nc4_get_vara_double: requested %.0f values, which is more than R can hold in one vector\n",
+			(double)tot_size );
+		INTEGER(sx_reterr)[0] = -1;
+		SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	PROTECT( sx_retdata = allocVector(REALSXP, (R_xlen_t)tot_size));
 	p_data = REAL( sx_retdata );
 
 	/* Actually read in the data now */
@@ -488,14 +595,14 @@ SEXP Rsx_nc4_get_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP s
 			nc_strerror( err ) );
 		Rprintf( "Var: %s  Ndims: %d   Start: ", vn, ndims );
 		for( i=0; i<ndims; i++ ) {
-			Rprintf( "%u", (unsigned int)s_start[i] );
+			Rprintf( "%lu", (unsigned long)s_start[i] );
 			if( i < ndims-1 )
 				Rprintf( "," );
 			}
 		Rprintf( " " );
 		Rprintf( "Count: " );
 		for( i=0; i<ndims; i++ ) {
-			Rprintf( "%u", (unsigned int)s_count[i] );
+			Rprintf( "%lu", (unsigned long)s_count[i] );
 			if( i < ndims-1 )
 				Rprintf( "," );
 			}
@@ -517,9 +624,9 @@ SEXP Rsx_nc4_get_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start, SEXP s
 		else
 			mvtol = fabs( missval ) * 1.e-5;
 
-		for( i=0L; i<tot_size; i++ ) {
-			if( fabs( p_data[i] - missval ) < mvtol )
-				p_data[i] = NA_REAL;
+		for( k=0L; k<tot_size; k++ ) {
+			if( fabs( p_data[k] - missval ) < mvtol )
+				p_data[k] = NA_REAL;
 			}
 		}
 
@@ -580,7 +687,7 @@ SEXP Rsx_nc4_get_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 	/* Sanity check -- number of start and count elements must
 	   match number of dims in the var
 	*/
-	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (INTEGER(sx_start)[0]==0) && (INTEGER(sx_count)[0]==1));
+	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (R_ncu4_sizet_elt(sx_start,0)==0) && (R_ncu4_sizet_elt(sx_count,0)==1));
 	if( (!scalar_var) && (ndims != GET_LENGTH(sx_start))) {
 		Rprintf( "Error in R_nc4_get_vara_int: I think var has %d dimensions, but passed start array is length %d. They must be the same!\n",
 			ndims, GET_LENGTH(sx_start) );
@@ -604,13 +711,24 @@ SEXP Rsx_nc4_get_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 	 */
 	tot_size = 1L;
 	for( i=0; i<ndims; i++ ) {
-		s_start[i] = (size_t)(INTEGER(sx_start)[i]);
-		s_count[i] = (size_t)(INTEGER(sx_count)[i]);
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
 		tot_size *= s_count[i];
 		}
 		
-	/* Make space for the returned data */
-	PROTECT( sx_retdata = allocVector(INTSXP, tot_size));
+	/* Make space for the returned data.  This can be a long vector
+	 * (more than 2^31-1 elements), but not more than R can index.
+	 */
+	if( tot_size > (size_t)R_XLEN_T_MAX ) {
+		Rprintf( "Error in Rsx_nc4_get_vara_int: requested %.0f values, which is more than R can hold in one vector\n",
+			(double)tot_size );
+		INTEGER(sx_reterr)[0] = -1;
+		SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	PROTECT( sx_retdata = allocVector(INTSXP, (R_xlen_t)tot_size));
 	p_data = INTEGER( sx_retdata );
 
 	/* Actually read in the data now */
@@ -621,13 +739,13 @@ SEXP Rsx_nc4_get_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 			nc_strerror( err ) );
 		Rprintf( "Var: %s  Ndims: %d   Start: ", vn, ndims );
 		for( i=0; i<ndims; i++ ) {
-			Rprintf( "%u", (unsigned int)s_start[i] );
+			Rprintf( "%lu", (unsigned long)s_start[i] );
 			if( i < ndims-1 )
 				Rprintf( "," );
 			}
 		Rprintf( " Count: " );
 		for( i=0; i<ndims; i++ ) {
-			Rprintf( "%u", (unsigned int)s_count[i] );
+			Rprintf( "%lu", (unsigned long)s_count[i] );
 			if( i < ndims-1 )
 				Rprintf( "," );
 			}
@@ -660,8 +778,8 @@ SEXP Rsx_nc4_get_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 }
 
 /*********************************************************************/
-void R_nc4_get_vara_text( int *ncid, int *varid, int *start, 
-	int *count, char **tempstore, char **data, int *retval )
+void R_nc4_get_vara_text( int *ncid, int *varid, double *start, 
+	double *count, char **tempstore, char **data, int *retval )
 {
 	int	i, err, ndims;
 	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], nstr, slen;
@@ -689,13 +807,13 @@ void R_nc4_get_vara_text( int *ncid, int *varid, int *start,
 			nc_strerror(*retval) );
 		Rprintf( "Var: %s  Ndims: %d   Start: ", vn, ndims );
 		for( i=0; i<ndims; i++ ) {
-			Rprintf( "%u", (unsigned int)s_start[i] );
+			Rprintf( "%lu", (unsigned long)s_start[i] );
 			if( i < ndims-1 )
 				Rprintf( "," );
 			}
 		Rprintf( " Count: " );
 		for( i=0; i<ndims; i++ ) {
-			Rprintf( "%u", (unsigned int)s_count[i] );
+			Rprintf( "%lu", (unsigned long)s_count[i] );
 			if( i < ndims-1 )
 				Rprintf( "," );
 			}
@@ -713,7 +831,7 @@ void R_nc4_get_vara_text( int *ncid, int *varid, int *start,
 /* Returns -1 if the dim is not found in the file. Otherwise,
  * returns the dimension's length
  */
-void R_nc4_inq_dimlen( int *ncid, char **dimname, int *dimlen )
+void R_nc4_inq_dimlen( int *ncid, char **dimname, double *dimlen )
 {
 	int err, dimid;
 	err = nc_inq_dimid(*ncid, dimname[0], &dimid );
@@ -724,7 +842,7 @@ void R_nc4_inq_dimlen( int *ncid, char **dimname, int *dimlen )
 
 	size_t st_dimlen;
 	err = nc_inq_dimlen( *ncid, dimid, &st_dimlen );
-	*dimlen = (int)st_dimlen;
+	*dimlen = (double)st_dimlen;
 }
 
 /*********************************************************************/
@@ -772,7 +890,7 @@ void R_nc4_inq_dimids( int *ncid, int *dimids, int *retval )
 }
 
 /*********************************************************************/
-void R_nc4_inq_dim( int *ncid, int *dimid, char **dimname, int *dimlen, int *unlim,
+void R_nc4_inq_dim( int *ncid, int *dimid, char **dimname, double *dimlen, int *unlim,
 				int *retval )
 {
 	char name[NC_MAX_NAME];
@@ -786,7 +904,7 @@ void R_nc4_inq_dim( int *ncid, int *dimid, char **dimname, int *dimlen, int *unl
 		return;
 		}
 
-	*dimlen = (int)len;
+	*dimlen = (double)len;
 	/* NOTE NOTE NOTE!! This assumes that the calling process
 	 * allocated storage of at least NC_MAX_NAME!
 	 */
@@ -867,6 +985,8 @@ void R_nc4_open( char **filename, int *cmode, int *ncid, int *retval )
 	if( *retval != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_open: %s\n", 
 			nc_strerror(*retval) );
+	else
+		R_ncu4_hier_flush( *ncid );	/* ids may be left from a file that had this ncid before */
 }
 
 /*********************************************************************/
@@ -897,6 +1017,8 @@ void R_nc4_create( char **filename, int *cmode, int *ncid, int *retval )
 	if( *retval != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_create: %s (creation mode was %d)\n", 
 			nc_strerror(*retval), nc_cmode );
+	else
+		R_ncu4_hier_flush( *ncid );	/* ids may be left from a file that had this ncid before */
 }
 
 /*********************************************************************/
@@ -1208,7 +1330,7 @@ SEXP Rsx_nc4_put_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 	/* Sanity check -- number of start and count elements must
 	   match nubmer of dims in the var
 	*/
-	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (INTEGER(sx_start)[0]==0) && (INTEGER(sx_count)[0]==1));
+	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (R_ncu4_sizet_elt(sx_start,0)==0) && (R_ncu4_sizet_elt(sx_count,0)==1));
 	if( (!scalar_var) && (ndims != GET_LENGTH(sx_start))) {
 		Rprintf( "Error in Rsx_nc4_put_vara_double: I think var has %d dimensions, but passed start array is length %d. They must be the same!\n",
 			ndims, GET_LENGTH(sx_start) );
@@ -1227,8 +1349,8 @@ SEXP Rsx_nc4_put_vara_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 
 	/* Copy over from ints to size_t */
 	for( i=0; i<ndims; i++ ) {
-		s_start[i] = (size_t)(INTEGER(sx_start)[i]);
-		s_count[i] = (size_t)(INTEGER(sx_count)[i]);
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
 		}
 
 	if( verbose ) {
@@ -1284,7 +1406,7 @@ SEXP Rsx_nc4_put_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 	/* Sanity check -- number of start and count elements must
 	   match nubmer of dims in the var
 	*/
-	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (INTEGER(sx_start)[0]==0) && (INTEGER(sx_count)[0]==1));
+	scalar_var = ((ndims==0) && (GET_LENGTH(sx_start)==1) && (R_ncu4_sizet_elt(sx_start,0)==0) && (R_ncu4_sizet_elt(sx_count,0)==1));
 	if( (!scalar_var) && (ndims != GET_LENGTH(sx_start))) {
 		Rprintf( "Error in Rsx_nc4_put_vara_int: I think var has %d dimensions, but passed start array is length %d. They must be the same!\n",
 			ndims, GET_LENGTH(sx_start) );
@@ -1303,8 +1425,8 @@ SEXP Rsx_nc4_put_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 
 	/* Copy over from ints to size_t */
 	for( i=0; i<ndims; i++ ) {
-		s_start[i] = (size_t)(INTEGER(sx_start)[i]);
-		s_count[i] = (size_t)(INTEGER(sx_count)[i]);
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
 		}
 
 	/* Actually write the data now */
@@ -1322,8 +1444,8 @@ SEXP Rsx_nc4_put_vara_int( SEXP sx_ncid, SEXP sx_varid, SEXP sx_start,
 }
 
 /**************************************************************************************************************/
-void R_nc4_put_vara_text( int *ncid, int *varid, int *start,
-	int *count, char **data, int *retval )
+void R_nc4_put_vara_text( int *ncid, int *varid, double *start,
+	double *count, char **data, int *retval )
 {
 	int	ndims, err, idx_string, idx_char, idx_j, idx_k;
 	size_t 	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], slen, slen2use;
@@ -1368,7 +1490,7 @@ void R_nc4_put_vara_text( int *ncid, int *varid, int *start,
 /* Rprintf( "slen2use=%lu\n", (unsigned long)slen2use ); */
 			s_count[idx_string] = 1L;
 			s_count[idx_char  ] = slen2use;
-			s_start[idx_string] = i + start[idx_string];
+			s_start[idx_string] = i + (size_t)start[idx_string];
 			s_start[idx_char  ] = 0L;
 			*retval = nc_put_vara_text(*ncid, *varid, s_start, s_count, data[i] );
 			if( *retval != NC_NOERR ) {
@@ -1398,8 +1520,8 @@ void R_nc4_put_vara_text( int *ncid, int *varid, int *start,
 			s_count[idx_j     ] = 1L;
 			s_count[idx_string] = 1L;
 			s_count[idx_char  ] = slen2use;
-			s_start[idx_j     ] = j + start[idx_j];
-			s_start[idx_string] = i + start[idx_string];
+			s_start[idx_j     ] = j + (size_t)start[idx_j];
+			s_start[idx_string] = i + (size_t)start[idx_string];
 			s_start[idx_char  ] = 0L;
 /* Rprintf( "writing following string: >%s<\n", data[stridx] ); */
 			*retval = nc_put_vara_text(*ncid, *varid, s_start, s_count, data[stridx++] );
@@ -1434,9 +1556,9 @@ void R_nc4_put_vara_text( int *ncid, int *varid, int *start,
 			s_count[idx_j     ] = 1L;
 			s_count[idx_string] = 1L;
 			s_count[idx_char  ] = slen2use;
-			s_start[idx_k     ] = k + start[idx_k];
-			s_start[idx_j     ] = j + start[idx_j];
-			s_start[idx_string] = i + start[idx_string];
+			s_start[idx_k     ] = k + (size_t)start[idx_k];
+			s_start[idx_j     ] = j + (size_t)start[idx_j];
+			s_start[idx_string] = i + (size_t)start[idx_string];
 			s_start[idx_char  ] = 0L;
 /* Rprintf( "writing following string: >%s<\n", data[stridx] ); */
 			*retval = nc_put_vara_text(*ncid, *varid, s_start, s_count, data[stridx++] );
@@ -1557,11 +1679,11 @@ void R_nc4_def_var_char( int *ncid, char **varname, int *ndims, int *dimids,
 }
 
 /*********************************************************************/
-void R_nc4_def_dim( int *ncid, char **dimname, int *size, int *dimid, 
+void R_nc4_def_dim( int *ncid, char **dimname, double *size, int *dimid, 
 	int *retval )
 {
 	*retval = nc_def_dim(*ncid, dimname[0], 
-		*size, dimid );
+		(size_t)(*size), dimid );
 	if( *retval != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_def_dim: %s\n", 
 			nc_strerror(*retval) );
@@ -1571,6 +1693,7 @@ void R_nc4_def_dim( int *ncid, char **dimname, int *size, int *dimid,
 void R_nc4_redef( int *ncid )
 {
 	int	err;
+	R_ncu4_hier_flush( *ncid );
 	err = nc_redef(*ncid);
 	if( err != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_redef: %s\n", 
@@ -1580,6 +1703,7 @@ void R_nc4_redef( int *ncid )
 /*********************************************************************/
 void R_nc4_rename_var( int *ncid, int *varid, char **newname, int *retval )
 {
+	R_ncu4_hier_flush( *ncid );
 	*retval = nc_rename_var( *ncid, *varid, newname[0] );
 	if( *retval != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_rename_var: %s\n", 
@@ -1965,6 +2089,148 @@ int R_nc4_util_nslashes( char *s, int *idx_first_slash )
 	return( nslashes );
 }
 
+/****************************************************************************************
+ * Cache of hierarchical name lookups.  Resolving a name such as "model1/run1/TS" takes
+ * one library call per group level, and is done on every access to a grouped var by
+ * name, so the results (group id and var or dim id) are kept in a hash table
+ * keyed by the ncid the name was looked up from, the kind of thing, and the name.  
+ * Only successful lookups are kept, so adding things does not make the table wrong;
+ * everything for a file is dropped when it goes into or out of define mode, a var
+ * is renamed, or the file is closed (or its ncid is given out again by nc_open).
+ */
+#define R_NCU4_HIER_VAR		0
+#define R_NCU4_HIER_DIM		1
+#define R_NCU4_HIER_NBUCKET	1024
+
+typedef struct R_ncu4_hent {
+	int			root, base, kind, gid, id;
+	char			*name;
+	struct R_ncu4_hent	*next;
+} R_ncu4_hent;
+
+static R_ncu4_hent *R_ncu4_hier_tab[R_NCU4_HIER_NBUCKET];
+
+static unsigned int R_ncu4_hier_hash( int base, int kind, const char *name )
+{
+	unsigned int	h = 2166136261u;
+
+	h = (h ^ (unsigned int)base) * 16777619u;
+	h = (h ^ (unsigned int)kind) * 16777619u;
+	while( *name != '\0' )
+		h = (h ^ (unsigned char)(*name++)) * 16777619u;
+
+	return( h % R_NCU4_HIER_NBUCKET );
+}
+
+/* The root group (file) ncid of group 'ncid' */
+static int R_ncu4_root_ncid( int ncid )
+{
+	int	parent;
+
+	while( nc_inq_grp_parent( ncid, &parent ) == NC_NOERR )
+		ncid = parent;
+
+	return( ncid );
+}
+
+static int R_ncu4_hier_find( int base, int kind, const char *name, int *gid, int *id )
+{
+	R_ncu4_hent	*e;
+
+	for( e=R_ncu4_hier_tab[ R_ncu4_hier_hash( base, kind, name ) ]; e != NULL; e=e->next )
+		if( (e->base == base) && (e->kind == kind) && (strcmp( e->name, name ) == 0)) {
+			*gid = e->gid;
+			*id  = e->id;
+			return( 1 );
+			}
+
+	return( 0 );
+}
+
+static void R_ncu4_hier_store( int base, int kind, const char *name, int gid, int id )
+{
+	R_ncu4_hent	*e;
+	unsigned int	h;
+
+	if( (e = (R_ncu4_hent *)malloc( sizeof(R_ncu4_hent) )) == NULL )
+		return;
+	if( (e->name = (char *)malloc( strlen(name)+1 )) == NULL ) {
+		free( e );
+		return;
+		}
+	strcpy( e->name, name );
+	e->root = R_ncu4_root_ncid( base );
+	e->base = base;
+	e->kind = kind;
+	e->gid  = gid;
+	e->id   = id;
+
+	h = R_ncu4_hier_hash( base, kind, name );
+	e->next = R_ncu4_hier_tab[h];
+	R_ncu4_hier_tab[h] = e;
+}
+
+/* Drops everything cached for the file that group 'ncid' is in */
+void R_ncu4_hier_flush( int ncid )
+{
+	int		root, h;
+	R_ncu4_hent	**pe, *e;
+
+	root = R_ncu4_root_ncid( ncid );
+	for( h=0; h<R_NCU4_HIER_NBUCKET; h++ ) {
+		pe = &(R_ncu4_hier_tab[h]);
+		while( (e = *pe) != NULL ) {
+			if( (e->root == root) || (e->base == ncid)) {
+				*pe = e->next;
+				free( e->name );
+				free( e );
+				}
+			else
+				pe = &(e->next);
+			}
+		}
+}
+
+/* Looks up a dim by its name relative to group 'ncid', through the cache.  Returns
+ * -1 in both ids if not found.
+ */
+static void R_ncu4_hier_lookup( int ncid, int kind, const char *name, int *returned_grpid, int *returned_id )
+{
+	char		gname[MAX_NC_NAME+1];
+	const char	*p, *slash;
+	int		gid, id, err;
+	size_t		len;
+
+	if( R_ncu4_hier_find( ncid, kind, name, returned_grpid, returned_id ))
+		return;
+
+	*returned_grpid = -1;
+	*returned_id    = -1;
+	if( name[0] == '/' )
+		return;
+
+	gid = ncid;
+	p   = name;
+	while( (slash = strchr( p, '/' )) != NULL ) {
+		len = (size_t)(slash - p);
+		if( len > MAX_NC_NAME )
+			return;
+		strncpy( gname, p, len );
+		gname[len] = '\0';
+		if( nc_inq_grp_ncid( gid, gname, &gid ) != NC_NOERR )
+			return;
+		p = slash + 1;
+		}
+
+	err = nc_inq_dimid( gid, p, &id );
+	if( err != NC_NOERR )
+		return;
+
+	*returned_grpid = gid;
+	*returned_id    = id;
+	R_ncu4_hier_store( ncid, kind, name, *returned_grpid, id );
+}
+
 /****************************************************************************************/
 void R_nc4_inq_varid_hier_inner( int *ncid, char *varname, int *returned_grpid, int *returned_varid )
 {
@@ -2027,13 +2293,28 @@ void R_nc4_inq_varid_hier_inner( int *ncid, char *varname, int *returned_grpid,
 void R_nc4_inq_varid_hier( int *ncid, char **varname, int *returned_grpid, int *returned_varid )
 {
 /* Rprintf("R_nc4_inq_varid_hier: entering for var >%s<\n", varname[0] ); */
+	if( R_ncu4_hier_find( *ncid, R_NCU4_HIER_VAR, varname[0], returned_grpid, returned_varid ))
+		return;
+
 	R_nc4_inq_varid_hier_inner( ncid, varname[0], returned_grpid, returned_varid );
+	if( *returned_varid != -1 )
+		R_ncu4_hier_store( *ncid, R_NCU4_HIER_VAR, varname[0], *returned_grpid, *returned_varid );
+}
+
+/****************************************************************************************/
+/* As R_nc4_inq_varid_hier, but for a dim such as "model1/lat".  Returns the id of the
+ * group the name leads to, and the dimid, or -1 in both if not found.
+ */
+void R_nc4_inq_dimid_hier( int *ncid, char **dimname, int *returned_grpid, int *returned_dimid )
+{
+	R_ncu4_hier_lookup( *ncid, R_NCU4_HIER_DIM, dimname[0], returned_grpid, returned_dimid );
 }
 
 /*********************************************************************/
 void R_nc4_enddef( int *ncid, int *retval )
 {
 	int	err;
+	R_ncu4_hier_flush( *ncid );
 	err = nc_enddef(*ncid);
 	if( err != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_enddef: %s\n", 
@@ -2056,6 +2337,7 @@ void R_nc4_sync( int *ncid )
 void R_nc4_close( int *ncid )
 {
 	int	err;
+	R_ncu4_hier_flush( *ncid );
 	err = nc_close(*ncid);
 	if( err != NC_NOERR ) 
 		Rprintf( "Error in R_nc4_close: %s\n", 
@@ -2588,7 +2870,7 @@ SEXP R_nc4_inq_libvers( void )
 SEXP R_nc4_get_vara_string( SEXP sx_nc, SEXP sx_varid, SEXP sx_start, SEXP sx_count ) 
 {
 	SEXP	sx_retval, sx_retnames, sx_retstrings, sx_reterror;
-	int	i, ierr, varid, ncid, ndims, count_int[MAX_NC_DIMS], start_int[MAX_NC_DIMS], len_count, len_start; 
+	int	i, ierr, varid, ncid, ndims, len_count, len_start; 
 	size_t	count[MAX_NC_DIMS], start[MAX_NC_DIMS], tot_count, isz;
 	char 	**ss;
 
@@ -2597,16 +2879,12 @@ SEXP R_nc4_get_vara_string( SEXP sx_nc, SEXP sx_varid, SEXP sx_start, SEXP sx_co
 	varid = INTEGER(sx_varid)[0];
 
 	len_start = length(sx_start);
-	for( i=0; i<len_start; i++ ) {
-		start_int[i] = INTEGER(sx_start)[i];
-		start    [i] = (size_t)(start_int[i]);
-		}
+	for( i=0; i<len_start; i++ ) 
+		start[i] = R_ncu4_sizet_elt( sx_start, i );
 
 	len_count = length(sx_count);
-	for( i=0; i<len_count; i++ ) {
-		count_int[i] = INTEGER(sx_count)[i];
-		count    [i] = (size_t)(count_int[i]);
-		}
+	for( i=0; i<len_count; i++ ) 
+		count[i] = R_ncu4_sizet_elt( sx_count, i );
 
 	PROTECT( sx_retval   = allocVector( VECSXP, 2 ));       /* 2 elements in the returned list: $error, $strings */
 
@@ -2665,3 +2943,4505 @@ SEXP R_nc4_get_vara_string( SEXP sx_nc, SEXP sx_varid, SEXP sx_start, SEXP sx_co
 	return( sx_retval );
 }
 
+
+/*********************************************************************************
+ * Calendar codes used by R_nc4_decode_time.  These same values are hard-coded
+ * into the R source (routine ncdim_time_calcode). Don't change them!
+ */
+#define R_NC_CAL_STANDARD	1
+#define R_NC_CAL_PROLEPTIC	2
+#define R_NC_CAL_JULIAN		3
+#define R_NC_CAL_NOLEAP		4
+#define R_NC_CAL_ALLLEAP	5
+#define R_NC_CAL_360DAY		6
+
+/* Julian day number of 1970-01-01 (Gregorian), and of 1582-10-15, the
+ * first day of the Gregorian calendar in the 'standard' calendar
+ */
+#define R_NC_JDN_EPOCH		2440588L
+#define R_NC_JDN_GREG_START	2299161L
+
+static const int R_ncu4_cumdays_noleap[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+static const int R_ncu4_cumdays_leap  [12] = { 0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335 };
+static const int R_ncu4_mdays_noleap  [12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+/* Floor division for possibly negative numerators */
+static long R_ncu4_floordiv( long a, long b )
+{
+	long q = a / b;
+	if( (a % b != 0) && ((a < 0) != (b < 0)))
+		q--;
+	return( q );
+}
+
+static int R_ncu4_isleap_greg( long y )
+{
+	return( ((y % 4 == 0) && (y % 100 != 0)) || (y % 400 == 0) );
+}
+
+/* Days since 1970-01-01 in the proleptic Gregorian calendar. After
+ * H. Hinnant's "days_from_civil" algorithm; valid for negative years.
+ */
+static long R_ncu4_days_from_greg( long y, long m, long d )
+{
+	long era, yoe, doy, doe;
+
+	y  -= (m <= 2);
+	era = R_ncu4_floordiv( y, 400L );
+	yoe = y - era*400L;
+	doy = (153L*(m + (m > 2 ? -3 : 9)) + 2L)/5L + d - 1L;
+	doe = yoe*365L + yoe/4L - yoe/100L + doy;
+	return( era*146097L + doe - 719468L );
+}
+
+static void R_ncu4_greg_from_days( long z, int *y, int *m, int *d )
+{
+	long era, doe, yoe, doy, mp, yy;
+
+	z  += 719468L;
+	era = R_ncu4_floordiv( z, 146097L );
+	doe = z - era*146097L;
+	yoe = (doe - doe/1460L + doe/36524L - doe/146096L) / 365L;
+	yy  = yoe + era*400L;
+	doy = doe - (365L*yoe + yoe/4L - yoe/100L);
+	mp  = (5L*doy + 2L)/153L;
+	*d  = (int)(doy - (153L*mp + 2L)/5L + 1L);
+	*m  = (int)(mp < 10 ? mp+3 : mp-9);
+	*y  = (int)(yy + (*m <= 2));
+}
+
+/* Days since 1970-01-01 (Gregorian) of a date given in the Julian calendar */
+static long R_ncu4_days_from_julian( long y, long m, long d )
+{
+	long a, yy, mm;
+
+	a  = (14L - m)/12L;
+	yy = y + 4800L - a;
+	mm = m + 12L*a - 3L;
+	return( d + (153L*mm + 2L)/5L + 365L*yy + R_ncu4_floordiv(yy,4L) - 32083L - R_NC_JDN_EPOCH );
+}
+
+static void R_ncu4_julian_from_days( long z, int *y, int *m, int *d )
+{
+	long c, dd, e, mm;
+
+	c  = z + R_NC_JDN_EPOCH + 32082L;
+	dd = R_ncu4_floordiv( 4L*c + 3L, 1461L );
+	e  = c - R_ncu4_floordiv( 1461L*dd, 4L );
+	mm = (5L*e + 2L)/153L;
+	*d = (int)(e - (153L*mm + 2L)/5L + 1L);
+	*m = (int)(mm + 3L - 12L*(mm/10L));
+	*y = (int)(dd - 4800L + mm/10L);
+}
+
+/* Converts a date in the given calendar to a day count.  For the real-world
+ * calendars (standard, proleptic_gregorian, julian) the count is days since
+ * 1970-01-01 in the Gregorian calendar; for the model calendars it is simply
+ * a consistent count of days in that calendar.
+ */
+static long R_ncu4_days_from_date( int cal, long y, long m, long d )
+{
+	switch( cal ) {
+		case R_NC_CAL_STANDARD:
+			if( (y > 1582) || ((y == 1582) && ((m > 10) || ((m == 10) && (d >= 15)))))
+				return( R_ncu4_days_from_greg( y, m, d ));
+			return( R_ncu4_days_from_julian( y, m, d ));
+
+		case R_NC_CAL_PROLEPTIC:
+			return( R_ncu4_days_from_greg( y, m, d ));
+
+		case R_NC_CAL_JULIAN:
+			return( R_ncu4_days_from_julian( y, m, d ));
+
+		case R_NC_CAL_NOLEAP:
+			return( y*365L + R_ncu4_cumdays_noleap[m-1] + d - 1L );
+
+		case R_NC_CAL_ALLLEAP:
+			return( y*366L + R_ncu4_cumdays_leap[m-1] + d - 1L );
+
+		case R_NC_CAL_360DAY:
+			return( y*360L + (m-1L)*30L + d - 1L );
+		}
+	return( 0L );
+}
+
+/* Inverse of R_ncu4_days_from_date; also returns the day of the year (1-based) */
+static void R_ncu4_date_from_days( int cal, long z, int *y, int *m, int *d, int *doy )
+{
+	long	yy, rem;
+	int	mm;
+
+	switch( cal ) {
+		case R_NC_CAL_STANDARD:
+		case R_NC_CAL_PROLEPTIC:
+		case R_NC_CAL_JULIAN:
+			if( (cal == R_NC_CAL_PROLEPTIC) ||
+			    ((cal == R_NC_CAL_STANDARD) && (z + R_NC_JDN_EPOCH >= R_NC_JDN_GREG_START)))
+				R_ncu4_greg_from_days( z, y, m, d );
+			else
+				R_ncu4_julian_from_days( z, y, m, d );
+			*doy = (int)(z - R_ncu4_days_from_date( cal, *y, 1L, 1L )) + 1;
+			return;
+
+		case R_NC_CAL_NOLEAP:
+		case R_NC_CAL_ALLLEAP:
+			if( cal == R_NC_CAL_NOLEAP ) {
+				yy  = R_ncu4_floordiv( z, 365L );
+				rem = z - yy*365L;
+				}
+			else
+				{
+				yy  = R_ncu4_floordiv( z, 366L );
+				rem = z - yy*366L;
+				}
+			for( mm=11; mm>0; mm-- ) {
+				if( rem >= ((cal == R_NC_CAL_NOLEAP) ? R_ncu4_cumdays_noleap[mm] : R_ncu4_cumdays_leap[mm]) )
+					break;
+				}
+			*y   = (int)yy;
+			*m   = mm + 1;
+			*d   = (int)(rem - ((cal == R_NC_CAL_NOLEAP) ? R_ncu4_cumdays_noleap[mm] : R_ncu4_cumdays_leap[mm])) + 1;
+			*doy = (int)rem + 1;
+			return;
+
+		case R_NC_CAL_360DAY:
+			yy   = R_ncu4_floordiv( z, 360L );
+			rem  = z - yy*360L;
+			*y   = (int)yy;
+			*m   = (int)(rem/30L) + 1;
+			*d   = (int)(rem%30L) + 1;
+			*doy = (int)rem + 1;
+			return;
+		}
+}
+
+/*********************************************************************************
+ * Decodes a CF-style time axis ("<units> since <origin>") into calendar
+ * components and POSIXct-style seconds since 1970-01-01 00:00:00 UTC.
+ *
+ *	sx_vals    : double, the raw time values from the file
+ *	sx_calcode : integer, one of the R_NC_CAL_* codes
+ *	sx_unitsec : double, number of seconds in one time unit
+ *	sx_origin  : double vector of 7: year, month, day, hour, min, sec,
+ *		     and the time zone offset of the origin in minutes
+ *
+ * For the real-world calendars the returned 'posix' value is the actual
+ * instant.  For the model calendars (noleap, all_leap, 360_day) it is the
+ * same calendar date and time taken as a Gregorian date, or NA if that date
+ * does not exist in the Gregorian calendar (e.g., Feb 30 in a 360_day calendar).
+ */
+SEXP R_nc4_decode_time( SEXP sx_vals, SEXP sx_calcode, SEXP sx_unitsec, SEXP sx_origin )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterror, sx_year, sx_month, sx_day, sx_hour, 
+		sx_minute, sx_second, sx_doy, sx_posix;
+	int	cal, y, m, d, doy, is_realcal, *iy, *im, *id, *ih, *imin, *idoy;
+	long	days, origin_days;
+	R_xlen_t i, n;
+	double	unitsec, *origin, origin_sec, t, sod, *vals, *sec, *posix;
+	const char *names[] = { "error", "year", "month", "day", "hour", "minute", "second", "doy", "posix" };
+
+	n       = xlength( sx_vals );
+	vals    = REAL( sx_vals );
+	cal     = INTEGER( sx_calcode )[0];
+	unitsec = REAL( sx_unitsec )[0];
+	origin  = REAL( sx_origin );
+
+	PROTECT( sx_retval   = allocVector( VECSXP, 9 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 9 ));
+	for( i=0; i<9; i++ )
+		SET_STRING_ELT( sx_retnames, i, mkChar(names[i]) );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+
+	PROTECT( sx_reterror = allocVector( INTSXP, 1 ));
+	INTEGER( sx_reterror )[0] = 0;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterror );
+	UNPROTECT(1);
+
+	if( (cal < R_NC_CAL_STANDARD) || (cal > R_NC_CAL_360DAY)) {
+		Rprintf( "Error in R_nc4_decode_time: unknown calendar code %d\n", cal );
+		INTEGER( sx_reterror )[0] = -1;
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+
+	PROTECT( sx_year   = allocVector( INTSXP,  n ));
+	PROTECT( sx_month  = allocVector( INTSXP,  n ));
+	PROTECT( sx_day    = allocVector( INTSXP,  n ));
+	PROTECT( sx_hour   = allocVector( INTSXP,  n ));
+	PROTECT( sx_minute = allocVector( INTSXP,  n ));
+	PROTECT( sx_second = allocVector( REALSXP, n ));
+	PROTECT( sx_doy    = allocVector( INTSXP,  n ));
+	PROTECT( sx_posix  = allocVector( REALSXP, n ));
+	iy    = INTEGER( sx_year   );
+	im    = INTEGER( sx_month  );
+	id    = INTEGER( sx_day    );
+	ih    = INTEGER( sx_hour   );
+	imin  = INTEGER( sx_minute );
+	sec   = REAL   ( sx_second );
+	idoy  = INTEGER( sx_doy    );
+	posix = REAL   ( sx_posix  );
+
+	is_realcal  = (cal == R_NC_CAL_STANDARD) || (cal == R_NC_CAL_PROLEPTIC) || (cal == R_NC_CAL_JULIAN);
+	origin_days = R_ncu4_days_from_date( cal, (long)origin[0], (long)origin[1], (long)origin[2] );
+	origin_sec  = origin[3]*3600.0 + origin[4]*60.0 + origin[5] - origin[6]*60.0;
+
+	for( i=0; i<n; i++ ) {
+		if( ISNAN( vals[i] ) || (! R_FINITE( vals[i] ))) {
+			iy[i] = im[i] = id[i] = ih[i] = imin[i] = idoy[i] = NA_INTEGER;
+			sec[i] = posix[i] = NA_REAL;
+			continue;
+			}
+
+		/* Seconds since the origin date at 00:00:00, split into whole
+		 * days and seconds of the day.  Round to the microsecond so that
+		 * values like 0.999999999 hours come out as exactly one hour.
+		 */
+		t    = origin_sec + vals[i]*unitsec;
+		days = (long)floor( t/86400.0 );
+		sod  = t - ((double)days)*86400.0;
+		sod  = floor( sod*1.e6 + 0.5 )/1.e6;
+		if( sod >= 86400.0 ) {
+			days++;
+			sod -= 86400.0;
+			}
+		days += origin_days;
+
+		R_ncu4_date_from_days( cal, days, &y, &m, &d, &doy );
+		iy  [i] = y;
+		im  [i] = m;
+		id  [i] = d;
+		idoy[i] = doy;
+		ih  [i] = (int)(sod/3600.0);
+		imin[i] = (int)((sod - ih[i]*3600.0)/60.0);
+		sec [i] = sod - ih[i]*3600.0 - imin[i]*60.0;
+
+		if( is_realcal )
+			posix[i] = ((double)days)*86400.0 + sod;
+		else if( (d > R_ncu4_mdays_noleap[m-1]) && 
+			 (! ((m == 2) && (d == 29) && R_ncu4_isleap_greg( y ))))
+			posix[i] = NA_REAL;
+		else
+			posix[i] = ((double)R_ncu4_days_from_greg( y, m, d ))*86400.0 + sod;
+		}
+
+	SET_VECTOR_ELT( sx_retval, 1, sx_year   );
+	SET_VECTOR_ELT( sx_retval, 2, sx_month  );
+	SET_VECTOR_ELT( sx_retval, 3, sx_day    );
+	SET_VECTOR_ELT( sx_retval, 4, sx_hour   );
+	SET_VECTOR_ELT( sx_retval, 5, sx_minute );
+	SET_VECTOR_ELT( sx_retval, 6, sx_second );
+	SET_VECTOR_ELT( sx_retval, 7, sx_doy    );
+	SET_VECTOR_ELT( sx_retval, 8, sx_posix  );
+
+	UNPROTECT(9);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * The inverse of R_nc4_decode_time: turns calendar components into
+ * time values with the given units and origin.  'sx_comp' holds n rows of
+ * (year, month, day, hour, minute, second), stored by column as R does.
+ * Used to turn date bounds into values that can be searched for directly
+ * in a time axis.
+ */
+SEXP R_nc4_encode_time( SEXP sx_comp, SEXP sx_calcode, SEXP sx_unitsec, SEXP sx_origin )
+{
+	SEXP	sx_retval;
+	int	cal;
+	long	origin_days, days;
+	R_xlen_t i, n;
+	double	*comp, *origin, *vals, unitsec, origin_sec, sod;
+
+	n       = xlength( sx_comp )/6;
+	comp    = REAL( sx_comp );
+	cal     = INTEGER( sx_calcode )[0];
+	unitsec = REAL( sx_unitsec )[0];
+	origin  = REAL( sx_origin );
+
+	if( (cal < R_NC_CAL_STANDARD) || (cal > R_NC_CAL_360DAY)) 
+		error( "Error in R_nc4_encode_time: unknown calendar code %d\n", cal );
+
+	PROTECT( sx_retval = allocVector( REALSXP, n ));
+	vals = REAL( sx_retval );
+
+	origin_days = R_ncu4_days_from_date( cal, (long)origin[0], (long)origin[1], (long)origin[2] );
+	origin_sec  = origin[3]*3600.0 + origin[4]*60.0 + origin[5] - origin[6]*60.0;
+
+	for( i=0; i<n; i++ ) {
+		if( ISNAN(comp[i]) || ISNAN(comp[n+i]) || ISNAN(comp[2*n+i]) ) {
+			vals[i] = NA_REAL;
+			continue;
+			}
+		days = R_ncu4_days_from_date( cal, (long)comp[i], (long)comp[n+i], (long)comp[2*n+i] );
+		sod  = comp[3*n+i]*3600.0 + comp[4*n+i]*60.0 + comp[5*n+i];
+		vals[i] = (((double)(days - origin_days))*86400.0 + sod - origin_sec) / unitsec;
+		}
+
+	UNPROTECT(1);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Scans a coordinate axis once and describes it, so that later range lookups
+ * can be done without scanning.  Returns a double vector of 4:
+ *	direction: 1 if strictly increasing, -1 if strictly decreasing, 0 otherwise
+ *	regular  : 1 if the values are evenly spaced (to a relative tolerance
+ *		   of 1e-6 of the spacing), 0 otherwise
+ *	v0, step : first value and spacing, valid if regular == 1
+ */
+SEXP R_nc4_coord_index( SEXP sx_vals )
+{
+	SEXP	sx_retval;
+	R_xlen_t i, n;
+	double	*vals, *rv, step, tol;
+	int	direction, regular;
+
+	n    = xlength( sx_vals );
+	vals = REAL( sx_vals );
+
+	PROTECT( sx_retval = allocVector( REALSXP, 4 ));
+	rv = REAL( sx_retval );
+
+	direction = 1;
+	regular   = 1;
+	step      = 0.0;
+	if( n > 1 ) {
+		direction = (vals[1] > vals[0]) ? 1 : -1;
+		step      = (vals[n-1] - vals[0]) / (double)(n-1);
+		tol       = 1.e-6*fabs(step);
+		for( i=0; i<n; i++ ) {
+			if( ISNAN( vals[i] )) {
+				direction = 0;
+				break;
+				}
+			if( (i > 0) && (((direction ==  1) && (vals[i] <= vals[i-1])) ||
+			                ((direction == -1) && (vals[i] >= vals[i-1])))) {
+				direction = 0;
+				break;
+				}
+			if( regular && (fabs( vals[i] - (vals[0] + step*(double)i)) > tol))
+				regular = 0;
+			}
+		}
+	if( direction == 0 )
+		regular = 0;
+
+	rv[0] = (double)direction;
+	rv[1] = (double)regular;
+	rv[2] = (n > 0) ? vals[0] : 0.0;
+	rv[3] = step;
+
+	UNPROTECT(1);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Finds the index range of the values of a coordinate axis that lie in the
+ * closed interval [lo,hi].  'sx_info' is what R_nc4_coord_index returned for
+ * this axis.  Regular axes are resolved by index arithmetic, other monotonic
+ * axes by a binary search, and non-monotonic axes by a scan.  If 'sx_hi' is 
+ * NA, the single value nearest to 'lo' is found instead.
+ *
+ * Returns an integer vector of 2: the R-style (1-based) start index and the
+ * count, which is 0 if no values lie in the interval.
+ */
+SEXP R_nc4_coord_range( SEXP sx_vals, SEXP sx_info, SEXP sx_lo, SEXP sx_hi )
+{
+	SEXP	sx_retval;
+	R_xlen_t n, i, first, last, a, b, mid;
+	double	*vals, *info, lo, hi, tmp, fa, fb;
+	int	direction, regular, nearest;
+
+	n         = xlength( sx_vals );
+	vals      = REAL( sx_vals );
+	info      = REAL( sx_info );
+	direction = (int)info[0];
+	regular   = (int)info[1];
+	lo        = REAL( sx_lo )[0];
+	hi        = REAL( sx_hi )[0];
+	nearest   = ISNAN( hi );
+	if( nearest )
+		hi = lo;
+	if( lo > hi ) {
+		tmp = lo;
+		lo  = hi;
+		hi  = tmp;
+		}
+
+	PROTECT( sx_retval = allocVector( INTSXP, 2 ));
+	INTEGER( sx_retval )[0] = 1;
+	INTEGER( sx_retval )[1] = 0;
+
+	if( n == 0 ) {
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+
+	first = 0;
+	last  = -1;
+
+	if( regular && (n > 1) && (info[3] != 0.0)) {
+		/*-----------------------------------
+		 * Evenly spaced: pure index arithmetic
+		 *-----------------------------------*/
+		fa = (lo - info[2]) / info[3];
+		fb = (hi - info[2]) / info[3];
+		if( fa > fb ) {
+			tmp = fa;
+			fa  = fb;
+			fb  = tmp;
+			}
+		/* Keep the casts below in range */
+		if( fa < -1.0      ) fa = -1.0;
+		if( fa > (double)n ) fa = (double)n;
+		if( fb < -1.0      ) fb = -1.0;
+		if( fb > (double)n ) fb = (double)n;
+		if( nearest ) {
+			first = (R_xlen_t)floor( fa + 0.5 );
+			if( first < 0   ) first = 0;
+			if( first > n-1 ) first = n-1;
+			last = first;
+			}
+		else
+			{
+			first = (R_xlen_t)ceil ( fa - 1.e-6 );
+			last  = (R_xlen_t)floor( fb + 1.e-6 );
+			if( first < 0   ) first = 0;
+			if( last  > n-1 ) last  = n-1;
+			}
+		}
+
+	else if( direction != 0 ) {
+		/*--------------------------------------------------------------
+		 * Monotonic: binary search for the first index whose value is
+		 * not before the start of the interval (in the axis' direction)
+		 *--------------------------------------------------------------*/
+		a = 0;
+		b = n;
+		while( a < b ) {
+			mid = a + (b-a)/2;
+			if( (direction == 1) ? (vals[mid] < lo) : (vals[mid] > hi))
+				a = mid + 1;
+			else
+				b = mid;
+			}
+		first = a;
+
+		if( nearest ) {
+			/* Closest of the neighbors on either side */
+			if( first >= n )
+				first = n-1;
+			else if( (first > 0) && (fabs(vals[first-1] - lo) <= fabs(vals[first] - lo)))
+				first = first-1;
+			last = first;
+			}
+		else
+			{
+			a = first;
+			b = n;
+			while( a < b ) {
+				mid = a + (b-a)/2;
+				if( (direction == 1) ? (vals[mid] <= hi) : (vals[mid] >= lo))
+					a = mid + 1;
+				else
+					b = mid;
+				}
+			last = a - 1;
+			}
+		}
+
+	else
+		{
+		/*----------------------------------------------------------
+		 * Not monotonic: the smallest index range that holds every
+		 * value in the interval (or the single nearest value)
+		 *----------------------------------------------------------*/
+		if( nearest ) {
+			tmp = -1.0;
+			for( i=0; i<n; i++ ) {
+				if( ISNAN( vals[i] ))
+					continue;
+				if( (tmp < 0.0) || (fabs(vals[i] - lo) < tmp)) {
+					tmp   = fabs(vals[i] - lo);
+					first = last = i;
+					}
+				}
+			}
+		else
+			{
+			for( i=0; i<n; i++ ) {
+				if( (! ISNAN(vals[i])) && (vals[i] >= lo) && (vals[i] <= hi)) {
+					if( last < first )
+						first = i;
+					last = i;
+					}
+				}
+			}
+		}
+
+	if( last >= first ) {
+		INTEGER( sx_retval )[0] = (int)(first + 1);
+		INTEGER( sx_retval )[1] = (int)(last - first + 1);
+		}
+
+	UNPROTECT(1);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * KD-tree for nearest-neighbor lookups on (possibly curvilinear) lat/lon grids.
+ * Points are stored as unit vectors in 3-D, so distances are chord lengths on
+ * the sphere.  This has no trouble with the dateline or the poles, and the
+ * nearest point by chord length is also the nearest by great circle distance.
+ *
+ * The tree is implicit: the points are reordered so that for any node covering
+ * [lo,hi), the splitting point is at mid=(lo+hi)/2, with smaller values along
+ * axis[mid] to the left and larger to the right.
+ */
+#define R_NC_KDTREE_LEAFSIZE	8
+#define R_NC_EARTH_RADIUS_KM	6371.0
+#ifndef M_PI
+#define M_PI	3.141592653589793238462643383280
+#endif
+
+typedef struct {
+	R_xlen_t	n;		/* number of (non-missing) points in tree */
+	double		*xyz;		/* 3*n coords of the points, in tree order */
+	R_xlen_t	*idx;		/* 0-based index of each point in the original grid */
+	unsigned char	*axis;		/* splitting axis of the node centered at each position */
+} R_ncu4_kdtree;
+
+static void R_ncu4_kdtree_free( R_ncu4_kdtree *kd )
+{
+	if( kd == NULL )
+		return;
+	if( kd->xyz  != NULL ) free( kd->xyz  );
+	if( kd->idx  != NULL ) free( kd->idx  );
+	if( kd->axis != NULL ) free( kd->axis );
+	free( kd );
+}
+
+static void R_ncu4_kdtree_finalizer( SEXP sx_tree )
+{
+	R_ncu4_kdtree_free( (R_ncu4_kdtree *)R_ExternalPtrAddr( sx_tree ));
+	R_ClearExternalPtr( sx_tree );
+}
+
+static void R_ncu4_kdtree_swap( R_ncu4_kdtree *kd, R_xlen_t a, R_xlen_t b )
+{
+	double		t;
+	R_xlen_t	ti;
+	int		k;
+
+	for( k=0; k<3; k++ ) {
+		t               = kd->xyz[3*a+k];
+		kd->xyz[3*a+k]  = kd->xyz[3*b+k];
+		kd->xyz[3*b+k]  = t;
+		}
+	ti         = kd->idx[a];
+	kd->idx[a] = kd->idx[b];
+	kd->idx[b] = ti;
+}
+
+/* Quickselect: reorders [lo,hi) so the point at 'kth' has the value it would 
+ * have if sorted along 'ax', with no larger values before it and no smaller after
+ */
+static void R_ncu4_kdtree_select( R_ncu4_kdtree *kd, R_xlen_t lo, R_xlen_t hi, R_xlen_t kth, int ax )
+{
+	R_xlen_t i, store;
+	double	pivot;
+
+	hi--;
+	while( hi > lo ) {
+		R_ncu4_kdtree_swap( kd, lo + (hi-lo)/2, hi );
+		pivot = kd->xyz[3*hi+ax];
+		store = lo;
+		for( i=lo; i<hi; i++ ) {
+			if( kd->xyz[3*i+ax] < pivot ) {
+				R_ncu4_kdtree_swap( kd, i, store );
+				store++;
+				}
+			}
+		R_ncu4_kdtree_swap( kd, store, hi );
+		if( store == kth )
+			return;
+		else if( store < kth )
+			lo = store + 1;
+		else
+			hi = store - 1;
+		}
+}
+
+static void R_ncu4_kdtree_build( R_ncu4_kdtree *kd, R_xlen_t lo, R_xlen_t hi )
+{
+	R_xlen_t i, mid;
+	double	mn[3], mx[3], spread, best;
+	int	k, ax;
+
+	if( hi - lo <= R_NC_KDTREE_LEAFSIZE )
+		return;
+
+	/* Split along the axis with the largest spread */
+	for( k=0; k<3; k++ ) {
+		mn[k] = kd->xyz[3*lo+k];
+		mx[k] = mn[k];
+		}
+	for( i=lo+1; i<hi; i++ ) 
+		for( k=0; k<3; k++ ) {
+			if( kd->xyz[3*i+k] < mn[k] ) mn[k] = kd->xyz[3*i+k];
+			if( kd->xyz[3*i+k] > mx[k] ) mx[k] = kd->xyz[3*i+k];
+			}
+	ax   = 0;
+	best = -1.0;
+	for( k=0; k<3; k++ ) {
+		spread = mx[k] - mn[k];
+		if( spread > best ) {
+			best = spread;
+			ax   = k;
+			}
+		}
+
+	mid = lo + (hi-lo)/2;
+	R_ncu4_kdtree_select( kd, lo, hi, mid, ax );
+	kd->axis[mid] = (unsigned char)ax;
+
+	R_ncu4_kdtree_build( kd, lo,    mid );
+	R_ncu4_kdtree_build( kd, mid+1, hi  );
+}
+
+static void R_ncu4_kdtree_nearest( R_ncu4_kdtree *kd, R_xlen_t lo, R_xlen_t hi, double *q, 
+	R_xlen_t *best_i, double *best_d2 )
+{
+	R_xlen_t i, mid;
+	double	d2, dd, diff;
+	int	k, ax;
+
+	if( hi <= lo )
+		return;
+
+	if( hi - lo <= R_NC_KDTREE_LEAFSIZE ) {
+		for( i=lo; i<hi; i++ ) {
+			d2 = 0.0;
+			for( k=0; k<3; k++ ) {
+				dd  = kd->xyz[3*i+k] - q[k];
+				d2 += dd*dd;
+				}
+			if( d2 < *best_d2 ) {
+				*best_d2 = d2;
+				*best_i  = i;
+				}
+			}
+		return;
+		}
+
+	mid = lo + (hi-lo)/2;
+	ax  = kd->axis[mid];
+
+	d2 = 0.0;
+	for( k=0; k<3; k++ ) {
+		dd  = kd->xyz[3*mid+k] - q[k];
+		d2 += dd*dd;
+		}
+	if( d2 < *best_d2 ) {
+		*best_d2 = d2;
+		*best_i  = mid;
+		}
+
+	/* Search the near side first, then the far side only if it could be closer */
+	diff = q[ax] - kd->xyz[3*mid+ax];
+	if( diff < 0.0 ) {
+		R_ncu4_kdtree_nearest( kd, lo, mid, q, best_i, best_d2 );
+		if( diff*diff < *best_d2 )
+			R_ncu4_kdtree_nearest( kd, mid+1, hi, q, best_i, best_d2 );
+		}
+	else
+		{
+		R_ncu4_kdtree_nearest( kd, mid+1, hi, q, best_i, best_d2 );
+		if( diff*diff < *best_d2 )
+			R_ncu4_kdtree_nearest( kd, lo, mid, q, best_i, best_d2 );
+		}
+}
+
+static void R_ncu4_latlon_to_xyz( double lat, double lon, double *xyz )
+{
+	double	rlat, rlon;
+
+	rlat   = lat * M_PI / 180.0;
+	rlon   = lon * M_PI / 180.0;
+	xyz[0] = cos(rlat) * cos(rlon);
+	xyz[1] = cos(rlat) * sin(rlon);
+	xyz[2] = sin(rlat);
+}
+
+/*********************************************************************************
+ * Builds a KD-tree from the lat and lon values (in degrees) of all the grid
+ * points, which can have any shape as long as lat and lon match.  Missing
+ * (NA) points are left out.  Returns an external pointer to the tree; the
+ * memory is freed when R garbage collects the pointer.
+ */
+SEXP R_nc4_kdtree_build( SEXP sx_lat, SEXP sx_lon )
+{
+	SEXP		sx_retval;
+	R_ncu4_kdtree	*kd;
+	R_xlen_t	i, n, np;
+	double		*lat, *lon;
+
+	n   = xlength( sx_lat );
+	lat = REAL( sx_lat );
+	lon = REAL( sx_lon );
+	if( xlength( sx_lon ) != n )
+		error( "Error in R_nc4_kdtree_build: lat and lon must have the same number of values\n" );
+
+	kd = (R_ncu4_kdtree *)calloc( 1, sizeof( R_ncu4_kdtree ));
+	if( kd != NULL ) {
+		kd->xyz  = (double *)       malloc( sizeof(double)   * 3 * (n > 0 ? n : 1));
+		kd->idx  = (R_xlen_t *)     malloc( sizeof(R_xlen_t) *     (n > 0 ? n : 1));
+		kd->axis = (unsigned char *)calloc( (n > 0 ? n : 1), sizeof(unsigned char));
+		}
+	if( (kd == NULL) || (kd->xyz == NULL) || (kd->idx == NULL) || (kd->axis == NULL)) {
+		R_ncu4_kdtree_free( kd );
+		error( "Error in R_nc4_kdtree_build: could not allocate space for a tree of %lu points\n", (unsigned long)n );
+		}
+
+	np = 0;
+	for( i=0; i<n; i++ ) {
+		if( ISNAN( lat[i] ) || ISNAN( lon[i] ))
+			continue;
+		R_ncu4_latlon_to_xyz( lat[i], lon[i], kd->xyz + 3*np );
+		kd->idx[np] = i;
+		np++;
+		}
+	kd->n = np;
+
+	R_ncu4_kdtree_build( kd, 0, np );
+
+	PROTECT( sx_retval = R_MakeExternalPtr( kd, R_NilValue, R_NilValue ));
+	R_RegisterCFinalizerEx( sx_retval, R_ncu4_kdtree_finalizer, TRUE );
+	UNPROTECT(1);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Finds the nearest grid point to each of the query points (lat, lon in degrees).
+ * Returns a list with:
+ *	$index    : 1-based index of the nearest grid point (as if the lat/lon 
+ *		    arrays the tree was built from were one long vector), or NA
+ *	$distance : great circle distance to that grid point, in km
+ */
+SEXP R_nc4_kdtree_query( SEXP sx_tree, SEXP sx_lat, SEXP sx_lon )
+{
+	SEXP		sx_retval, sx_retnames, sx_index, sx_dist;
+	R_ncu4_kdtree	*kd;
+	R_xlen_t	i, n, best_i;
+	double		*lat, *lon, *dist, q[3], best_d2;
+	int		*index;
+
+	kd = (R_ncu4_kdtree *)R_ExternalPtrAddr( sx_tree );
+	if( kd == NULL )
+		error( "Error in R_nc4_kdtree_query: the tree is no longer valid (was it saved and reloaded?)\n" );
+
+	n   = xlength( sx_lat );
+	lat = REAL( sx_lat );
+	lon = REAL( sx_lon );
+
+	PROTECT( sx_retval   = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("index") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("distance") );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+
+	PROTECT( sx_index = allocVector( INTSXP,  n ));
+	PROTECT( sx_dist  = allocVector( REALSXP, n ));
+	index = INTEGER( sx_index );
+	dist  = REAL( sx_dist );
+
+	for( i=0; i<n; i++ ) {
+		if( ISNAN( lat[i] ) || ISNAN( lon[i] ) || (kd->n == 0)) {
+			index[i] = NA_INTEGER;
+			dist [i] = NA_REAL;
+			continue;
+			}
+		R_ncu4_latlon_to_xyz( lat[i], lon[i], q );
+		best_i  = -1;
+		best_d2 = 10.0;		/* larger than any squared chord on the unit sphere */
+		R_ncu4_kdtree_nearest( kd, 0, kd->n, q, &best_i, &best_d2 );
+		index[i] = (int)(kd->idx[best_i] + 1);
+		dist [i] = 2.0 * asin( fmin( 1.0, sqrt(best_d2)/2.0 )) * R_NC_EARTH_RADIUS_KM;
+		}
+
+	SET_VECTOR_ELT( sx_retval, 0, sx_index );
+	SET_VECTOR_ELT( sx_retval, 1, sx_dist  );
+	UNPROTECT(3);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Missing values are matched as ncvar_get matches them: exactly for the integer 
+ * types up to uint (for which R_ncu4_mvtol returns 0), and to within a relative 
+ * 1e-5 for float, double, int64 and uint64.  The streaming routines below take 
+ * the var's type code (precint) for this.
+ */
+static double R_ncu4_mvtol( int precint, double missval )
+{
+	if( (precint == 3) || (precint == 4))
+		return( (missval == 0.0) ? 1.e-10 : fabs( missval ) * 1.e-5 );
+	if( (precint == 10) || (precint == 11))
+		return( fabs( missval * 1.e-5 ));
+	return( 0.0 );
+}
+
+static int R_ncu4_ismissval( double v, double missval, double mvtol )
+{
+	return( (mvtol == 0.0) ? (v == missval) : (fabs( v - missval ) < mvtol) );
+}
+
+/*********************************************************************************
+ * Reads the values of a variable at a set of grid points, in one call.
+ *
+ *	sx_start, sx_count : C-style start and count for all the var's dims; the
+ *		entries for the point dims are ignored
+ *	sx_pdims : C-style (0-based) indices of the var's dims that the points 
+ *		index, in C order
+ *	sx_pidx  : 0-based indices of the points along each of those dims, stored
+ *		as npoints rows by npdims columns (R matrix order)
+ *	sx_precint : the var's type code; decides how missing values are matched
+ *		(see R_ncu4_mvtol)
+ *	sx_imvstate, sx_missval : as in Rsx_nc4_get_vara_double
+ *
+ * Returns a list with $error and $data.  $data has the points varying fastest,
+ * followed by the other (non-point) dims in R order, i.e., it can be given R 
+ * dims of c(npoints, rev(count of the other dims)).
+ *
+ * If the points are dense in their bounding box, the box is read in slabs and
+ * the points picked out of it; otherwise each point is read separately.
+ */
+SEXP R_nc4_get_points_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_pdims, SEXP sx_pidx, SEXP sx_imvstate, SEXP sx_missval )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_retdata;
+	int	ncid, varid, precint, ndims, npdims, imvstate, ispoint[MAX_NC_DIMS], *pdims, *pidx, 
+		i, k, err, firstother;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], stride[MAX_NC_DIMS], 
+		pmin[MAX_NC_DIMS], pmax[MAX_NC_DIMS], np, ne, ip, ie, nbox, nslab, slab_ne, 
+		nblock, iblock, ib, idx, *base, *eoff;
+	double	*out, *buf, missval, mvtol;
+	const size_t max_buf = 8388608L;	/* 64 MB of doubles */
+
+	ncid     = INTEGER(sx_ncid    )[0];
+	varid    = INTEGER(sx_varid   )[0];
+	precint  = INTEGER(sx_precint )[0];
+	imvstate = INTEGER(sx_imvstate)[0];
+	missval  = REAL   (sx_missval )[0];
+	pdims    = INTEGER(sx_pdims);
+	pidx     = INTEGER(sx_pidx);
+	npdims   = length(sx_pdims);
+	np       = (size_t)(xlength(sx_pidx) / (npdims > 0 ? npdims : 1));
+
+	PROTECT( sx_retval = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("data" ) );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = 0;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_varndims( ncid, varid, &ndims );
+	if( (err != NC_NOERR) || (ndims != length(sx_start)) || (ndims != length(sx_count)) || (npdims < 1)) {
+		Rprintf( "Error in R_nc4_get_points_double: bad ndims or start/count (%s)\n", nc_strerror(err) );
+		INTEGER(sx_reterr)[0] = -1;
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		ispoint[i] = 0;
+		}
+
+	/* Bounding box of the points, and total count along the other dims */
+	for( k=0; k<npdims; k++ ) {
+		ispoint[pdims[k]] = 1;
+		pmin[k] = pmax[k] = (size_t)pidx[(size_t)k*np];
+		for( ip=1; ip<np; ip++ ) {
+			idx = (size_t)pidx[(size_t)k*np + ip];
+			if( idx < pmin[k] ) pmin[k] = idx;
+			if( idx > pmax[k] ) pmax[k] = idx;
+			}
+		}
+	ne   = 1L;
+	nbox = 1L;
+	firstother = -1;
+	for( i=0; i<ndims; i++ ) {
+		if( ispoint[i] ) 
+			continue;
+		ne *= s_count[i];
+		if( firstother == -1 )
+			firstother = i;
+		}
+	for( k=0; k<npdims; k++ ) 
+		nbox *= (pmax[k] - pmin[k] + 1L);
+
+	PROTECT( sx_retdata = allocVector( REALSXP, np*ne ));
+	out = REAL( sx_retdata );
+
+	if( (np > 0) && (nbox <= 64L*np) && (nbox <= max_buf)) {
+		/*--------------------------------------------------------------
+		 * Dense: read the bounding box, a slab of the first non-point
+		 * dim at a time, and pick the points out of it
+		 *--------------------------------------------------------------*/
+		for( k=0; k<npdims; k++ ) {
+			s_start[pdims[k]] = pmin[k];
+			s_count[pdims[k]] = pmax[k] - pmin[k] + 1L;
+			}
+
+		nblock  = (firstother == -1) ? 1L : s_count[firstother];
+		slab_ne = (firstother == -1) ? 1L : ne / (nblock > 0 ? nblock : 1L);
+		nslab   = max_buf / (nbox*slab_ne > 0 ? nbox*slab_ne : 1L);
+		if( nslab < 1L     ) nslab = 1L;
+		if( nslab > nblock ) nslab = nblock;
+
+		base = (size_t *)R_alloc( np,                                 sizeof(size_t));
+		eoff = (size_t *)R_alloc( slab_ne*nslab > 0 ? slab_ne*nslab : 1L, sizeof(size_t));
+		buf = (double *)R_alloc( nbox*slab_ne*nslab, sizeof(double));
+		for( iblock=0; iblock<nblock; iblock+=nslab ) {
+			if( firstother != -1 ) {
+				s_start[firstother] = R_ncu4_sizet_elt( sx_start, firstother ) + iblock;
+				s_count[firstother] = (iblock + nslab <= nblock) ? nslab : (nblock - iblock);
+				}
+			ib = (firstother == -1) ? 1L : s_count[firstother];
+
+			/* Offsets into the slab buffer of each point, and of each
+			 * element along the other dims.  These depend on the slab
+			 * size, which can be smaller for the last slab.
+			 */
+			stride[ndims-1] = 1L;
+			for( i=ndims-2; i>=0; i-- )
+				stride[i] = stride[i+1] * s_count[i+1];
+			for( ip=0; ip<np; ip++ ) {
+				base[ip] = 0L;
+				for( k=0; k<npdims; k++ )
+					base[ip] += ((size_t)pidx[(size_t)k*np + ip] - pmin[k]) * stride[pdims[k]];
+				}
+			for( ie=0; ie<slab_ne*ib; ie++ ) {
+				idx      = ie;	/* decompose ie over the other dims, C order */
+				eoff[ie] = 0L;
+				for( i=ndims-1; i>=0; i-- ) {
+					if( ispoint[i] )
+						continue;
+					eoff[ie] += (idx % s_count[i]) * stride[i];
+					idx      /= s_count[i];
+					}
+				}
+
+			err = nc_get_vara_double( ncid, varid, s_start, s_count, buf );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_get_points_double: %s\n", nc_strerror( err ));
+				INTEGER(sx_reterr)[0] = -1;
+				UNPROTECT(3);
+				return( sx_retval );
+				}
+			for( ie=0; ie<slab_ne*ib; ie++ )
+				for( ip=0; ip<np; ip++ )
+					out[ip + np*(iblock*slab_ne + ie)] = buf[ base[ip] + eoff[ie] ];
+			R_CheckUserInterrupt();
+			}
+		}
+	else
+		{
+		/*-------------------------------------------------
+		 * Sparse: read each point's values separately
+		 *-------------------------------------------------*/
+		buf = (double *)R_alloc( ne > 0 ? ne : 1L, sizeof(double));
+		for( k=0; k<npdims; k++ )
+			s_count[pdims[k]] = 1L;
+		for( ip=0; ip<np; ip++ ) {
+			for( k=0; k<npdims; k++ )
+				s_start[pdims[k]] = (size_t)pidx[(size_t)k*np + ip];
+			err = nc_get_vara_double( ncid, varid, s_start, s_count, buf );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_get_points_double: %s\n", nc_strerror( err ));
+				INTEGER(sx_reterr)[0] = -1;
+				UNPROTECT(3);
+				return( sx_retval );
+				}
+			for( ie=0; ie<ne; ie++ )
+				out[ip + np*ie] = buf[ie];
+			if( ip % 1000 == 0 )
+				R_CheckUserInterrupt();
+			}
+		}
+
+	/* Same missing value handling as ncvar_get */
+	if( imvstate == 2 ) {
+		mvtol = R_ncu4_mvtol( precint, missval );
+		for( idx=0L; idx<np*ne; idx++ ) 
+			if( R_ncu4_ismissval( out[idx], missval, mvtol ))
+				out[idx] = NA_REAL;
+		}
+
+	SET_VECTOR_ELT( sx_retval, 1, sx_retdata );
+	UNPROTECT(3);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Returns element i of a start or count vector passed from R as a size_t.  The
+ * vector can be integer or double; double allows values past 2^31.
+ */
+static size_t R_ncu4_sizet_elt( SEXP sx_v, int i )
+{
+	if( TYPEOF(sx_v) == REALSXP )
+		return( (size_t)(REAL(sx_v)[i]) );
+
+	return( (size_t)(INTEGER(sx_v)[i]) );
+}
+
+/*********************************************************************************
+ * Stepping through a hyperslab (s_start, s_count) in blocks of size blk.  Along
+ * each dim, block edges fall on multiples of blk[i] (in file index space), so if 
+ * blk is a multiple of the chunk size each chunk is read only once.  The first 
+ * and last blocks along a dim can be partial.  The block is (b_start, b_count).
+ */
+static void R_ncu4_block_edge( int i, size_t *s_start, size_t *s_count, size_t *blk, 
+	size_t *b_start, size_t *b_count )
+{
+	b_count[i] = (b_start[i]/blk[i] + 1L)*blk[i] - b_start[i];
+	if( b_start[i] + b_count[i] > s_start[i] + s_count[i] )
+		b_count[i] = s_start[i] + s_count[i] - b_start[i];
+}
+
+static void R_ncu4_block_first( int ndims, size_t *s_start, size_t *s_count, size_t *blk, 
+	size_t *b_start, size_t *b_count )
+{
+	int	i;
+
+	for( i=0; i<ndims; i++ ) {
+		b_start[i] = s_start[i];
+		R_ncu4_block_edge( i, s_start, s_count, blk, b_start, b_count );
+		}
+}
+
+/* Moves to the next block, fastest varying dim first.  Returns 0 if there are no more */
+static int R_ncu4_block_next( int ndims, size_t *s_start, size_t *s_count, size_t *blk, 
+	size_t *b_start, size_t *b_count )
+{
+	int	i;
+
+	for( i=ndims-1; i>=0; i-- ) {
+		b_start[i] += b_count[i];
+		if( b_start[i] < s_start[i] + s_count[i] ) {
+			R_ncu4_block_edge( i, s_start, s_count, blk, b_start, b_count );
+			return( 1 );
+			}
+		b_start[i] = s_start[i];
+		R_ncu4_block_edge( i, s_start, s_count, blk, b_start, b_count );
+		}
+
+	return( 0 );
+}
+
+/*********************************************************************************
+ * Accumulators for the streaming reductions.  Any of the arrays except count
+ * can be NULL if that statistic is not wanted.  mean and m2 are the running 
+ * mean and sum of squared deviations (Welford's method), used for the sd.
+ */
+typedef struct {
+	double	*count, *sum, *min, *max, *mean, *m2;
+	int	imvstate;
+	double	missval, mvtol, scale, offset;
+} R_ncu4_accum;
+
+/*--------------------------------------------------------------------------------
+ * Adds n values, spaced 'os' apart in the output, to the accumulators starting
+ * at output index o.  Missing values are skipped, and scale/offset applied.
+ * If 'group' is not NULL, value k goes to output index o + group[k]*os instead,
+ * and is skipped if group[k] is negative.
+ */
+static void R_ncu4_accum_row( R_ncu4_accum *acc, double *vals, size_t n, size_t o0, size_t os, 
+	int *group )
+{
+	size_t	k, o;
+	double	v, delta;
+
+	for( k=0; k<n; k++ ) {
+		v = vals[k];
+		if( ISNAN(v) || ((acc->imvstate == 2) && R_ncu4_ismissval( v, acc->missval, acc->mvtol )))
+			continue;
+		if( group == NULL )
+			o = o0 + k*os;
+		else if( group[k] < 0 )
+			continue;
+		else
+			o = o0 + (size_t)group[k]*os;
+		v = v*acc->scale + acc->offset;
+
+		acc->count[o] += 1.0;
+		if( acc->sum != NULL )
+			acc->sum[o] += v;
+		if( acc->min != NULL ) {
+			if( (acc->count[o] == 1.0) || (v < acc->min[o]))
+				acc->min[o] = v;
+			}
+		if( acc->max != NULL ) {
+			if( (acc->count[o] == 1.0) || (v > acc->max[o]))
+				acc->max[o] = v;
+			}
+		if( acc->mean != NULL ) {
+			delta        = v - acc->mean[o];
+			acc->mean[o] += delta / acc->count[o];
+			acc->m2[o]   += delta * (v - acc->mean[o]);
+			}
+		}
+}
+
+/*********************************************************************************
+ * Reduces a variable over some of its dims (for example, a time mean) without
+ * reading the whole thing into memory.  The hyperslab given by start and count 
+ * is read in blocks, each of which is accumulated into the (much smaller) output 
+ * arrays and then discarded.
+ *
+ *	sx_start, sx_count : C-style start and count (integer or double)
+ *	sx_reduce : for each dim (C order), 1 if it is reduced over, 0 if kept
+ *	sx_block  : block size to read along each dim (C order).  Blocks are 
+ *		aligned on multiples of this size, so if it is a multiple of the 
+ *		chunk size, each chunk is read only once
+ *	sx_want   : bit flags for the statistics to accumulate: 1=sum, 2=min,
+ *		4=max, 8=mean and sum of squared deviations.  Counts are always kept
+ *	sx_precint : the var's type code; decides how missing values are matched
+ *		(see R_ncu4_mvtol)
+ *	sx_imvstate, sx_missval : as in Rsx_nc4_get_vara_double
+ *	sx_scale, sx_offset : applied to the non-missing values as they are read
+ *	sx_gdim   : C-style index of a dim whose elements are accumulated into 
+ *		groups (for example, the months of a time axis), or -1 for none
+ *	sx_groups : for each element along dim gdim (from start), the 0-based
+ *		group it belongs to, or -1 to leave it out
+ *	sx_ngroups: number of groups.  In the output, the group dim is kept in
+ *		the place of dim gdim, with length ngroups
+ *
+ * Returns a list with $error, $count, $sum, $min, $max, $mean, and $m2.  The
+ * statistics have one entry per element of the kept dims, in R order; the ones
+ * that were not wanted are NULL.  Where count is zero, the other values are 
+ * meaningless.
+ */
+SEXP R_nc4_reduce_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_reduce, SEXP sx_block, SEXP sx_want, SEXP sx_imvstate, SEXP sx_missval,
+	SEXP sx_scale, SEXP sx_offset, SEXP sx_gdim, SEXP sx_groups, SEXP sx_ngroups )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_stat;
+	int	ncid, varid, ndims, want, i, err, *reduce, last, gdim, *groups, g, 
+		nprot = 0;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], 
+		b_start[MAX_NC_DIMS], b_count[MAX_NC_DIMS], ostride[MAX_NC_DIMS], 
+		pos[MAX_NC_DIMS], nout, nbuf, nrow, irow, o;
+	double	*buf, *stat[6];
+	R_ncu4_accum acc;
+	const char *statnames[7] = { "error", "count", "sum", "min", "max", "mean", "m2" };
+
+	ncid         = INTEGER(sx_ncid    )[0];
+	varid        = INTEGER(sx_varid   )[0];
+	want         = INTEGER(sx_want    )[0];
+	reduce       = INTEGER(sx_reduce);
+	acc.imvstate = INTEGER(sx_imvstate)[0];
+	acc.missval  = REAL   (sx_missval )[0];
+	acc.mvtol    = R_ncu4_mvtol( INTEGER(sx_precint)[0], acc.missval );
+	acc.scale    = REAL   (sx_scale   )[0];
+	acc.offset   = REAL   (sx_offset  )[0];
+	gdim         = INTEGER(sx_gdim    )[0];
+	groups       = INTEGER(sx_groups  );
+
+	PROTECT( sx_retval = allocVector( VECSXP, 7 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 7 ));
+	for( i=0; i<7; i++ )
+		SET_STRING_ELT( sx_retnames, i, mkChar( statnames[i] ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = 0;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+	nprot = 2;
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_varndims( ncid, varid, &ndims );
+	if( (err != NC_NOERR) || (ndims < 1) || (ndims != length(sx_start)) || (ndims != length(sx_count)) 
+			|| (ndims != length(sx_reduce)) || (ndims != length(sx_block)) || (gdim >= ndims)) {
+		Rprintf( "Error in R_nc4_reduce_double: bad ndims or start/count (%s)\n", nc_strerror(err) );
+		INTEGER(sx_reterr)[0] = -1;
+		UNPROTECT(nprot);
+		return( sx_retval );
+		}
+
+	/* Output strides of the kept dims; reduced dims do not move the output */
+	nout = 1L;
+	nbuf = 1L;
+	for( i=ndims-1; i>=0; i-- ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		blk[i]     = R_ncu4_sizet_elt( sx_block, i );
+		if( blk[i] < 1L        ) blk[i] = 1L;
+		if( blk[i] > s_count[i]) blk[i] = (s_count[i] > 0L) ? s_count[i] : 1L;
+		nbuf *= blk[i];
+		if( i == gdim ) {
+			ostride[i] = nout;
+			nout      *= (size_t)(INTEGER(sx_ngroups)[0]);
+			}
+		else if( reduce[i] )
+			ostride[i] = 0L;
+		else
+			{
+			ostride[i] = nout;
+			nout      *= s_count[i];
+			}
+		}
+	if( (gdim >= 0) && ((size_t)length(sx_groups) != s_count[gdim])) {
+		Rprintf( "Error in R_nc4_reduce_double: groups has %d entries, but count along the group dim is %lu\n",
+			length(sx_groups), (unsigned long)s_count[gdim] );
+		INTEGER(sx_reterr)[0] = -1;
+		UNPROTECT(nprot);
+		return( sx_retval );
+		}
+
+	for( i=0; i<6; i++ ) {
+		if( (i == 0) || ((i == 1) && (want & 1)) || ((i == 2) && (want & 2)) || ((i == 3) && (want & 4)) || ((i >= 4) && (want & 8))) {
+			PROTECT( sx_stat = allocVector( REALSXP, nout ));
+			nprot++;
+			stat[i] = REAL(sx_stat);
+			for( o=0L; o<nout; o++ )
+				stat[i][o] = 0.0;
+			SET_VECTOR_ELT( sx_retval, i+1, sx_stat );
+			}
+		else
+			stat[i] = NULL;
+		}
+	acc.count = stat[0];
+	acc.sum   = stat[1];
+	acc.min   = stat[2];
+	acc.max   = stat[3];
+	acc.mean  = stat[4];
+	acc.m2    = stat[5];
+
+	for( i=0; i<ndims; i++ )
+		if( s_count[i] == 0L ) {
+			UNPROTECT(nprot);
+			return( sx_retval );
+			}
+
+	buf  = (double *)R_alloc( nbuf, sizeof(double));
+	last = ndims - 1;
+
+	R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+	do {
+		err = nc_get_vara_double( ncid, varid, b_start, b_count, buf );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_reduce_double: %s\n", nc_strerror( err ));
+			INTEGER(sx_reterr)[0] = -1;
+			UNPROTECT(nprot);
+			return( sx_retval );
+			}
+
+		/* Accumulate the block a row (along the fastest dim) at a time */
+		nrow = 1L;
+		for( i=0; i<last; i++ ) {
+			nrow  *= b_count[i];
+			pos[i] = 0L;
+			}
+		for( irow=0L; irow<nrow; irow++ ) {
+			o = (gdim == last) ? 0L : (b_start[last] - s_start[last]) * ostride[last];
+			for( i=0; i<last; i++ ) {
+				if( i == gdim ) {
+					g = groups[ b_start[i] - s_start[i] + pos[i] ];
+					if( g < 0 )
+						break;
+					o += (size_t)g * ostride[i];
+					}
+				else
+					o += (b_start[i] - s_start[i] + pos[i]) * ostride[i];
+				}
+			if( i == last )	/* row is not in a left-out group */
+				R_ncu4_accum_row( &acc, buf + irow*b_count[last], b_count[last], o, ostride[last],
+					(gdim == last) ? groups + (b_start[last] - s_start[last]) : NULL );
+
+			for( i=last-1; i>=0; i-- ) {
+				if( ++pos[i] < b_count[i] )
+					break;
+				pos[i] = 0L;
+				}
+			}
+		R_CheckUserInterrupt();
+		}
+	while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+
+	UNPROTECT(nprot);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Removes the missing values from the n values in buf, and applies the scale 
+ * and offset in 'acc' to the rest, which are moved to the front of buf.  Returns
+ * the number of valid values.
+ */
+static size_t R_ncu4_mask_scale( R_ncu4_accum *acc, double *buf, size_t n )
+{
+	size_t	k, nvalid;
+	double	v;
+
+	nvalid = 0L;
+	for( k=0; k<n; k++ ) {
+		v = buf[k];
+		if( ISNAN(v) || ((acc->imvstate == 2) && R_ncu4_ismissval( v, acc->missval, acc->mvtol )))
+			continue;
+		buf[nvalid++] = v*acc->scale + acc->offset;
+		}
+
+	return( nvalid );
+}
+
+/*********************************************************************************
+ * A t-digest (Dunning & Ertl), which summarizes the distribution of any number 
+ * of values in a bounded number of centroids, so that quantiles can be estimated 
+ * accurately (especially the extreme ones).  Digests made from different data can
+ * be merged.  This is the "merging" variant with the k1 (arcsine) scale function:
+ * values are collected in a buffer, and when it fills, the buffer and the existing
+ * centroids are sorted together and merged into new centroids.
+ */
+#define R_NC_TDIGEST_BUFSIZE	32768
+
+typedef struct {
+	double	m, w;
+} R_ncu4_centroid;
+
+typedef struct {
+	double		compression;
+	size_t		n, cap;		/* number of centroids, and room for them */
+	R_ncu4_centroid	*c;
+	size_t		nbuf;
+	R_ncu4_centroid	*buf;
+	double		min, max;
+	int		npass;		/* merges go alternately up and down, to avoid bias */
+} R_ncu4_tdigest;
+
+static int R_ncu4_centroid_cmp( const void *a, const void *b )
+{
+	double	ma = ((const R_ncu4_centroid *)a)->m, 
+		mb = ((const R_ncu4_centroid *)b)->m;
+
+	return( (ma < mb) ? -1 : ((ma > mb) ? 1 : 0));
+}
+
+/* The k1 scale function and its inverse */
+static double R_ncu4_tdigest_k( double q, double compression )
+{
+	return( compression / (2.0*M_PI) * asin( 2.0*q - 1.0 ));
+}
+
+static double R_ncu4_tdigest_kinv( double k, double compression )
+{
+	if( k >= compression/4.0 )
+		return( 1.0 );
+	return( (sin( k * 2.0*M_PI / compression ) + 1.0) / 2.0 );
+}
+
+/* Space is from R_alloc, so is freed when the .Call returns */
+static void R_ncu4_tdigest_init( R_ncu4_tdigest *td, double compression, size_t ncentroids_in )
+{
+	td->compression = compression;
+	td->n    = 0L;
+	td->cap  = (size_t)(ceil( compression * M_PI / 2.0 )) + 10L;	/* can have no more than this after a merge */
+	td->c    = (R_ncu4_centroid *)R_alloc( td->cap + R_NC_TDIGEST_BUFSIZE + ncentroids_in, sizeof(R_ncu4_centroid));
+	td->nbuf = 0L;
+	td->buf  = td->c + td->cap;	/* buffer sits right after the centroids, so they can be sorted together */
+	td->min  = R_PosInf;
+	td->max  = R_NegInf;
+	td->npass = 0;
+}
+
+/* Merges the buffered values into the centroids */
+static void R_ncu4_centroid_reverse( R_ncu4_centroid *c, size_t n )
+{
+	size_t		i;
+	R_ncu4_centroid	t;
+
+	for( i=0; i<n/2; i++ ) {
+		t        = c[i];
+		c[i]     = c[n-1-i];
+		c[n-1-i] = t;
+		}
+}
+
+static void R_ncu4_tdigest_compress( R_ncu4_tdigest *td )
+{
+	R_ncu4_centroid	*all, cur;
+	size_t		nall, i, nout;
+	int		down;
+	double		total, wsofar, qlimit;
+
+	if( td->nbuf == 0L )
+		return;
+
+	/* Centroids and buffer together, sorted by mean */
+	all  = td->c;
+	if( td->n < td->cap )
+		memmove( all + td->n, td->buf, td->nbuf * sizeof(R_ncu4_centroid));
+	nall = td->n + td->nbuf;
+	qsort( all, nall, sizeof(R_ncu4_centroid), R_ncu4_centroid_cmp );
+	down = (td->npass++ % 2);
+	if( down )
+		R_ncu4_centroid_reverse( all, nall );
+
+	total = 0.0;
+	for( i=0; i<nall; i++ )
+		total += all[i].w;
+
+	nout   = 0L;
+	wsofar = 0.0;
+	qlimit = total * R_ncu4_tdigest_kinv( R_ncu4_tdigest_k( 0.0, td->compression ) + 1.0, td->compression );
+	cur    = all[0];
+	for( i=1; i<nall; i++ ) {
+		if( wsofar + cur.w + all[i].w <= qlimit ) {
+			cur.m += (all[i].m - cur.m) * all[i].w / (cur.w + all[i].w);
+			cur.w += all[i].w;
+			}
+		else
+			{
+			wsofar      += cur.w;
+			all[nout++]  = cur;
+			qlimit       = total * R_ncu4_tdigest_kinv( R_ncu4_tdigest_k( wsofar/total, td->compression ) + 1.0, 
+						td->compression );
+			cur = all[i];
+			}
+		}
+	all[nout++] = cur;
+	if( down )
+		R_ncu4_centroid_reverse( all, nout );
+
+	td->n    = nout;
+	td->nbuf = 0L;
+	td->buf  = td->c + td->cap;
+}
+
+static void R_ncu4_tdigest_add( R_ncu4_tdigest *td, double m, double w )
+{
+	if( td->nbuf == R_NC_TDIGEST_BUFSIZE )
+		R_ncu4_tdigest_compress( td );
+	td->buf[td->nbuf].m = m;
+	td->buf[td->nbuf].w = w;
+	td->nbuf++;
+	if( m < td->min ) td->min = m;
+	if( m > td->max ) td->max = m;
+}
+
+/*********************************************************************************
+ * Streams through a variable (or the hyperslab of it given by start and count),
+ * in blocks as in R_nc4_reduce_double, and accumulates a histogram and/or a 
+ * t-digest of its valid values.
+ *
+ *	sx_breaks      : the histogram's break points, in increasing order.  Bins are
+ *		closed on the right, and the first is also closed on the left, as with 
+ *		R's hist().  If there are fewer than 2 breaks, no histogram is made
+ *	sx_compression : the t-digest's compression (about 100 is usual); if <= 0,
+ *		no t-digest is made
+ *
+ * The other args are as in R_nc4_reduce_double.  Returns a list with $error, 
+ * $nvalid, $nmissing, $counts, $nbelow, $nabove (the number of values below the 
+ * first and above the last break), $mean and $weight (of the t-digest centroids),
+ * and $min and $max.
+ */
+SEXP R_nc4_stream_stats_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_block, SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset, 
+	SEXP sx_breaks, SEXP sx_compression )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_el;
+	int	ncid, varid, ndims, i, err, nbreaks;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], 
+		b_start[MAX_NC_DIMS], b_count[MAX_NC_DIMS], nbuf, nb, nvalid, k, lo, hi, mid;
+	double	*buf, *breaks, *counts, ntot_valid, ntot_missing, nbelow, nabove, v, 
+		compression, vmin, vmax;
+	R_ncu4_accum	acc;
+	R_ncu4_tdigest	td;
+	const char *names[10] = { "error", "nvalid", "nmissing", "counts", "nbelow", "nabove", 
+		"mean", "weight", "min", "max" };
+
+	ncid         = INTEGER(sx_ncid    )[0];
+	varid        = INTEGER(sx_varid   )[0];
+	acc.imvstate = INTEGER(sx_imvstate)[0];
+	acc.missval  = REAL   (sx_missval )[0];
+	acc.mvtol    = R_ncu4_mvtol( INTEGER(sx_precint)[0], acc.missval );
+	acc.scale    = REAL   (sx_scale   )[0];
+	acc.offset   = REAL   (sx_offset  )[0];
+	breaks      = REAL(sx_breaks);
+	nbreaks     = length(sx_breaks);
+	compression = REAL(sx_compression)[0];
+
+	PROTECT( sx_retval = allocVector( VECSXP, 10 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 10 ));
+	for( i=0; i<10; i++ )
+		SET_STRING_ELT( sx_retnames, i, mkChar( names[i] ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = 0;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_varndims( ncid, varid, &ndims );
+	if( (err != NC_NOERR) || (ndims < 1) || (ndims != length(sx_start)) || (ndims != length(sx_count)) 
+			|| (ndims != length(sx_block))) {
+		Rprintf( "Error in R_nc4_stream_stats_double: bad ndims or start/count (%s)\n", nc_strerror(err) );
+		INTEGER(sx_reterr)[0] = -1;
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	nbuf = 1L;
+	nb   = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		blk[i]     = R_ncu4_sizet_elt( sx_block, i );
+		if( blk[i] < 1L        ) blk[i] = 1L;
+		if( blk[i] > s_count[i]) blk[i] = (s_count[i] > 0L) ? s_count[i] : 1L;
+		nbuf *= blk[i];
+		nb   *= s_count[i];
+		}
+
+	counts = (double *)R_alloc( (nbreaks > 1) ? nbreaks-1 : 1, sizeof(double));
+	for( i=0; i<nbreaks-1; i++ )
+		counts[i] = 0.0;
+	if( compression > 0.0 )
+		R_ncu4_tdigest_init( &td, compression, 0L );
+	buf = (double *)R_alloc( nbuf, sizeof(double));
+
+	ntot_valid   = 0.0;
+	ntot_missing = 0.0;
+	nbelow = nabove = 0.0;
+	vmin = R_PosInf;
+	vmax = R_NegInf;
+	if( nb > 0L ) {
+		R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+		do {
+			err = nc_get_vara_double( ncid, varid, b_start, b_count, buf );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_stream_stats_double: %s\n", nc_strerror( err ));
+				INTEGER(sx_reterr)[0] = -1;
+				UNPROTECT(2);
+				return( sx_retval );
+				}
+			nb = 1L;
+			for( i=0; i<ndims; i++ )
+				nb *= b_count[i];
+			nvalid        = R_ncu4_mask_scale( &acc, buf, nb );
+			ntot_valid   += (double)nvalid;
+			ntot_missing += (double)(nb - nvalid);
+
+			for( k=0; k<nvalid; k++ ) {
+				v = buf[k];
+				if( v < vmin ) vmin = v;
+				if( v > vmax ) vmax = v;
+				}
+
+			/* Histogram: binary search for the bin, (breaks[lo], breaks[lo+1]] */
+			if( nbreaks > 1 ) {
+				for( k=0; k<nvalid; k++ ) {
+					v = buf[k];
+					if( v < breaks[0] ) {
+						nbelow += 1.0;
+						continue;
+						}
+					if( v > breaks[nbreaks-1] ) {
+						nabove += 1.0;
+						continue;
+						}
+					lo = 0L;
+					hi = nbreaks-1;
+					while( hi - lo > 1L ) {
+						mid = (lo + hi)/2L;
+						if( v > breaks[mid] )
+							lo = mid;
+						else
+							hi = mid;
+						}
+					counts[lo] += 1.0;
+					}
+				}
+
+			if( compression > 0.0 )
+				for( k=0; k<nvalid; k++ )
+					R_ncu4_tdigest_add( &td, buf[k], 1.0 );
+
+			R_CheckUserInterrupt();
+			}
+		while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+		}
+
+	SET_VECTOR_ELT( sx_retval, 1, ScalarReal( ntot_valid   ));
+	SET_VECTOR_ELT( sx_retval, 2, ScalarReal( ntot_missing ));
+	if( nbreaks > 1 ) {
+		PROTECT( sx_el = allocVector( REALSXP, nbreaks-1 ));
+		for( i=0; i<nbreaks-1; i++ )
+			REAL(sx_el)[i] = counts[i];
+		SET_VECTOR_ELT( sx_retval, 3, sx_el );
+		UNPROTECT(1);
+		}
+	SET_VECTOR_ELT( sx_retval, 4, ScalarReal( nbelow ));
+	SET_VECTOR_ELT( sx_retval, 5, ScalarReal( nabove ));
+	if( compression > 0.0 ) {
+		R_ncu4_tdigest_compress( &td );
+		PROTECT( sx_el = allocVector( REALSXP, td.n ));
+		for( k=0; k<td.n; k++ )
+			REAL(sx_el)[k] = td.c[k].m;
+		SET_VECTOR_ELT( sx_retval, 6, sx_el );
+		UNPROTECT(1);
+		PROTECT( sx_el = allocVector( REALSXP, td.n ));
+		for( k=0; k<td.n; k++ )
+			REAL(sx_el)[k] = td.c[k].w;
+		SET_VECTOR_ELT( sx_retval, 7, sx_el );
+		UNPROTECT(1);
+		}
+	SET_VECTOR_ELT( sx_retval, 8, ScalarReal( (ntot_valid > 0.0) ? vmin : NA_REAL ));
+	SET_VECTOR_ELT( sx_retval, 9, ScalarReal( (ntot_valid > 0.0) ? vmax : NA_REAL ));
+
+	UNPROTECT(2);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Merges t-digest centroids (for example, the concatenated centroids of several
+ * digests) into a single digest with the given compression.  Returns a list with 
+ * $mean and $weight of the merged centroids.
+ */
+SEXP R_nc4_tdigest_merge( SEXP sx_mean, SEXP sx_weight, SEXP sx_compression )
+{
+	SEXP		sx_retval, sx_retnames, sx_el;
+	R_ncu4_tdigest	td;
+	size_t		k, n;
+
+	n = (size_t)xlength(sx_mean);
+	R_ncu4_tdigest_init( &td, REAL(sx_compression)[0], n );
+	for( k=0; k<n; k++ ) {	/* the buffer has room for all n */
+		td.buf[td.nbuf].m = REAL(sx_mean  )[k];
+		td.buf[td.nbuf].w = REAL(sx_weight)[k];
+		td.nbuf++;
+		}
+	R_ncu4_tdigest_compress( &td );
+
+	PROTECT( sx_retval = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("mean"  ));
+	SET_STRING_ELT( sx_retnames, 1, mkChar("weight"));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+
+	PROTECT( sx_el = allocVector( REALSXP, td.n ));
+	for( k=0; k<td.n; k++ )
+		REAL(sx_el)[k] = td.c[k].m;
+	SET_VECTOR_ELT( sx_retval, 0, sx_el );
+	UNPROTECT(1);
+	PROTECT( sx_el = allocVector( REALSXP, td.n ));
+	for( k=0; k<td.n; k++ )
+		REAL(sx_el)[k] = td.c[k].w;
+	SET_VECTOR_ELT( sx_retval, 1, sx_el );
+	UNPROTECT(2);
+
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Estimates quantiles 'probs' from t-digest centroids (sorted by mean) and the 
+ * min and max of the data, by interpolating between the centroids' means, each
+ * of which is taken to sit at the middle of its share of the total weight.
+ */
+SEXP R_nc4_tdigest_quantile( SEXP sx_mean, SEXP sx_weight, SEXP sx_min, SEXP sx_max, SEXP sx_probs )
+{
+	SEXP	sx_retval;
+	double	*m, *w, vmin, vmax, total, t, cum, lo_pos, hi_pos, lo_val, hi_val;
+	size_t	n, k, ip, np;
+
+	m    = REAL(sx_mean);
+	w    = REAL(sx_weight);
+	n    = (size_t)xlength(sx_mean);
+	vmin = REAL(sx_min)[0];
+	vmax = REAL(sx_max)[0];
+	np   = (size_t)xlength(sx_probs);
+
+	PROTECT( sx_retval = allocVector( REALSXP, np ));
+
+	total = 0.0;
+	for( k=0; k<n; k++ )
+		total += w[k];
+
+	for( ip=0; ip<np; ip++ ) {
+		t = REAL(sx_probs)[ip] * total;
+		if( (n == 0L) || ISNAN(t)) {
+			REAL(sx_retval)[ip] = NA_REAL;
+			continue;
+			}
+
+		/* Walk the centroid midpoints; before the first is the min, after the last is the max */
+		lo_pos = 0.0;
+		lo_val = vmin;
+		hi_pos = total;
+		hi_val = vmax;
+		cum    = 0.0;
+		for( k=0; k<n; k++ ) {
+			if( cum + w[k]/2.0 >= t ) {
+				hi_pos = cum + w[k]/2.0;
+				hi_val = m[k];
+				break;
+				}
+			lo_pos = cum + w[k]/2.0;
+			lo_val = m[k];
+			cum   += w[k];
+			}
+		if( hi_pos > lo_pos )
+			REAL(sx_retval)[ip] = lo_val + (hi_val - lo_val) * (t - lo_pos) / (hi_pos - lo_pos);
+		else
+			REAL(sx_retval)[ip] = hi_val;
+		}
+
+	UNPROTECT(1);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Builds a statistics index for a variable: reads it one chunk at a time (the 
+ * block size, sx_block, should be the chunk size) and, for each chunk, finds the 
+ * min and max of the valid values and the number of missing values.  The chunks
+ * are visited in the order of R_ncu4_block_next, i.e., with the last (C order)
+ * dim varying fastest.  The other args are as in R_nc4_reduce_double.  Returns 
+ * a list with $error, and per chunk, $min, $max (NA if the chunk has no valid 
+ * values), $nvalid, and $nmissing.
+ */
+SEXP R_nc4_chunk_stats_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_block, SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_min, sx_max, sx_nvalid, sx_nmissing;
+	int	ncid, varid, ndims, i, err;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], 
+		b_start[MAX_NC_DIMS], b_count[MAX_NC_DIMS], nbuf, nb, nvalid, k, ichunk, nchunks;
+	double	*buf, v, vmin, vmax;
+	R_ncu4_accum	acc;
+	const char *names[5] = { "error", "min", "max", "nvalid", "nmissing" };
+
+	ncid         = INTEGER(sx_ncid    )[0];
+	varid        = INTEGER(sx_varid   )[0];
+	acc.imvstate = INTEGER(sx_imvstate)[0];
+	acc.missval  = REAL   (sx_missval )[0];
+	acc.mvtol    = R_ncu4_mvtol( INTEGER(sx_precint)[0], acc.missval );
+	acc.scale    = REAL   (sx_scale   )[0];
+	acc.offset   = REAL   (sx_offset  )[0];
+
+	PROTECT( sx_retval = allocVector( VECSXP, 5 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 5 ));
+	for( i=0; i<5; i++ )
+		SET_STRING_ELT( sx_retnames, i, mkChar( names[i] ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = 0;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_varndims( ncid, varid, &ndims );
+	if( (err != NC_NOERR) || (ndims < 1) || (ndims != length(sx_start)) || (ndims != length(sx_count)) 
+			|| (ndims != length(sx_block))) {
+		Rprintf( "Error in R_nc4_chunk_stats_double: bad ndims or start/count (%s)\n", nc_strerror(err) );
+		INTEGER(sx_reterr)[0] = -1;
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	nbuf    = 1L;
+	nchunks = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		blk[i]     = R_ncu4_sizet_elt( sx_block, i );
+		if( blk[i] < 1L        ) blk[i] = 1L;
+		if( blk[i] > s_count[i]) blk[i] = (s_count[i] > 0L) ? s_count[i] : 1L;
+		nbuf    *= blk[i];
+		nchunks *= (s_count[i] + blk[i] - 1L) / blk[i];
+		}
+
+	PROTECT( sx_min      = allocVector( REALSXP, nchunks ));
+	PROTECT( sx_max      = allocVector( REALSXP, nchunks ));
+	PROTECT( sx_nvalid   = allocVector( REALSXP, nchunks ));
+	PROTECT( sx_nmissing = allocVector( REALSXP, nchunks ));
+	SET_VECTOR_ELT( sx_retval, 1, sx_min      );
+	SET_VECTOR_ELT( sx_retval, 2, sx_max      );
+	SET_VECTOR_ELT( sx_retval, 3, sx_nvalid   );
+	SET_VECTOR_ELT( sx_retval, 4, sx_nmissing );
+	UNPROTECT(4);
+
+	buf = (double *)R_alloc( nbuf, sizeof(double));
+
+	ichunk = 0L;
+	if( nchunks > 0L ) {
+		R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+		do {
+			err = nc_get_vara_double( ncid, varid, b_start, b_count, buf );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_chunk_stats_double: %s\n", nc_strerror( err ));
+				INTEGER(sx_reterr)[0] = -1;
+				UNPROTECT(2);
+				return( sx_retval );
+				}
+			nb = 1L;
+			for( i=0; i<ndims; i++ )
+				nb *= b_count[i];
+			nvalid = R_ncu4_mask_scale( &acc, buf, nb );
+
+			vmin = R_PosInf;
+			vmax = R_NegInf;
+			for( k=0; k<nvalid; k++ ) {
+				v = buf[k];
+				if( v < vmin ) vmin = v;
+				if( v > vmax ) vmax = v;
+				}
+			REAL(sx_min     )[ichunk] = (nvalid > 0L) ? vmin : NA_REAL;
+			REAL(sx_max     )[ichunk] = (nvalid > 0L) ? vmax : NA_REAL;
+			REAL(sx_nvalid  )[ichunk] = (double)nvalid;
+			REAL(sx_nmissing)[ichunk] = (double)(nb - nvalid);
+			ichunk++;
+
+			R_CheckUserInterrupt();
+			}
+		while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+		}
+
+	UNPROTECT(2);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Finds the values in a set of blocks of a variable that satisfy a comparison.
+ * The blocks (usually the chunks that R_nc4_chunk_stats_double showed could hold
+ * a match) are given by sx_bstart and sx_bcount, C-style starts and counts with 
+ * ndims values per block.  sx_op is one of the R_NC_WHERE_* codes below; the 
+ * comparison is against sx_lo (and also sx_hi for 'between', which is closed
+ * at both ends).  Missing values are masked and the scale and offset are applied
+ * as in R_nc4_reduce_double before the comparison, and only match R_NC_WHERE_ISNA.
+ *
+ * Returns a list with $error, $index, a matrix of the (1-based, R order) indices
+ * of the matches, one row per match, and $vals, the matching values.
+ */
+#define R_NC_WHERE_GT		1
+#define R_NC_WHERE_GE		2
+#define R_NC_WHERE_LT		3
+#define R_NC_WHERE_LE		4
+#define R_NC_WHERE_EQ		5
+#define R_NC_WHERE_NE		6
+#define R_NC_WHERE_BETWEEN	7
+#define R_NC_WHERE_ISNA		8
+
+SEXP R_nc4_where_double( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_bstart, SEXP sx_bcount, 
+	SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset, SEXP sx_op, 
+	SEXP sx_lo, SEXP sx_hi )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_index, sx_vals, sx_dim;
+	int	ncid, varid, ndims, i, err, op, ismiss, match, imvstate;
+	size_t	b_start[MAX_NC_DIMS], b_count[MAX_NC_DIMS], pos[MAX_NC_DIMS], nblocks, ib,
+		nbuf, nb, k, nfound, cap, *idx, *newidx;
+	double	*buf, *vals, *newvals, v, lo, hi, missval, mvtol, scale, offset;
+	const char *names[3] = { "error", "index", "vals" };
+
+	ncid     = INTEGER(sx_ncid    )[0];
+	varid    = INTEGER(sx_varid   )[0];
+	imvstate = INTEGER(sx_imvstate)[0];
+	missval  = REAL   (sx_missval )[0];
+	scale    = REAL   (sx_scale   )[0];
+	offset   = REAL   (sx_offset  )[0];
+	op       = INTEGER(sx_op      )[0];
+	lo       = REAL   (sx_lo      )[0];
+	hi       = REAL   (sx_hi      )[0];
+	mvtol    = R_ncu4_mvtol( INTEGER(sx_precint)[0], missval );
+
+	PROTECT( sx_retval = allocVector( VECSXP, 3 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 3 ));
+	for( i=0; i<3; i++ )
+		SET_STRING_ELT( sx_retnames, i, mkChar( names[i] ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = 0;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_varndims( ncid, varid, &ndims );
+	if( (err != NC_NOERR) || (ndims < 1) || (xlength(sx_bstart) % ndims != 0) 
+			|| (xlength(sx_bstart) != xlength(sx_bcount))) {
+		Rprintf( "Error in R_nc4_where_double: bad ndims or block starts/counts (%s)\n", nc_strerror(err) );
+		INTEGER(sx_reterr)[0] = -1;
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+	nblocks = (size_t)xlength(sx_bstart) / ndims;
+
+	/* Largest block sets the buffer size */
+	nbuf = 1L;
+	for( ib=0; ib<nblocks; ib++ ) {
+		nb = 1L;
+		for( i=0; i<ndims; i++ )
+			nb *= R_ncu4_sizet_elt( sx_bcount, ib*ndims + i );
+		if( nb > nbuf )
+			nbuf = nb;
+		}
+	buf = (double *)R_alloc( nbuf, sizeof(double));
+
+	/* Matches are collected in space that grows as needed; it is all freed on return */
+	nfound = 0L;
+	cap    = 1024L;
+	idx    = (size_t *)R_alloc( cap*ndims, sizeof(size_t));
+	vals   = (double *)R_alloc( cap,       sizeof(double));
+
+	for( ib=0; ib<nblocks; ib++ ) {
+		nb = 1L;
+		for( i=0; i<ndims; i++ ) {
+			b_start[i] = R_ncu4_sizet_elt( sx_bstart, ib*ndims + i );
+			b_count[i] = R_ncu4_sizet_elt( sx_bcount, ib*ndims + i );
+			pos[i]     = 0L;
+			nb        *= b_count[i];
+			}
+		if( nb == 0L )
+			continue;
+
+		err = nc_get_vara_double( ncid, varid, b_start, b_count, buf );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_where_double: %s\n", nc_strerror( err ));
+			INTEGER(sx_reterr)[0] = -1;
+			UNPROTECT(2);
+			return( sx_retval );
+			}
+
+		for( k=0; k<nb; k++ ) {
+			v      = buf[k];
+			ismiss = ISNAN(v) || ((imvstate == 2) && R_ncu4_ismissval( v, missval, mvtol ));
+			if( ismiss ) {
+				match = (op == R_NC_WHERE_ISNA);
+				v     = NA_REAL;
+				}
+			else
+				{
+				v = v*scale + offset;
+				switch( op ) {
+					case R_NC_WHERE_GT:      match = (v >  lo); break;
+					case R_NC_WHERE_GE:      match = (v >= lo); break;
+					case R_NC_WHERE_LT:      match = (v <  lo); break;
+					case R_NC_WHERE_LE:      match = (v <= lo); break;
+					case R_NC_WHERE_EQ:      match = (v == lo); break;
+					case R_NC_WHERE_NE:      match = (v != lo); break;
+					case R_NC_WHERE_BETWEEN: match = ((v >= lo) && (v <= hi)); break;
+					default:                 match = 0;
+					}
+				}
+
+			if( match ) {
+				if( nfound == cap ) {
+					newidx  = (size_t *)R_alloc( 2L*cap*ndims, sizeof(size_t));
+					newvals = (double *)R_alloc( 2L*cap,       sizeof(double));
+					memcpy( newidx,  idx,  cap*ndims*sizeof(size_t));
+					memcpy( newvals, vals, cap*sizeof(double));
+					idx  = newidx;
+					vals = newvals;
+					cap *= 2L;
+					}
+				for( i=0; i<ndims; i++ )
+					idx[nfound*ndims + i] = b_start[i] + pos[i];
+				vals[nfound++] = v;
+				}
+
+			/* Position within the block of the next value, last dim fastest */
+			for( i=ndims-1; i>=0; i-- ) {
+				if( ++pos[i] < b_count[i] )
+					break;
+				pos[i] = 0L;
+				}
+			}
+
+		R_CheckUserInterrupt();
+		}
+
+	/* Index matrix is in R order and 1-based */
+	PROTECT( sx_index = allocVector( REALSXP, nfound*ndims ));
+	for( k=0; k<nfound; k++ )
+		for( i=0; i<ndims; i++ )
+			REAL(sx_index)[ k + nfound*(ndims-1-i) ] = (double)(idx[k*ndims + i] + 1L);
+	PROTECT( sx_dim = allocVector( INTSXP, 2 ));
+	INTEGER(sx_dim)[0] = (int)nfound;
+	INTEGER(sx_dim)[1] = ndims;
+	setAttrib( sx_index, R_DimSymbol, sx_dim );
+	SET_VECTOR_ELT( sx_retval, 1, sx_index );
+	UNPROTECT(2);
+
+	PROTECT( sx_vals = allocVector( REALSXP, nfound ));
+	for( k=0; k<nfound; k++ )
+		REAL(sx_vals)[k] = vals[k];
+	SET_VECTOR_ELT( sx_retval, 2, sx_vals );
+	UNPROTECT(1);
+
+	UNPROTECT(2);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Copies all the attributes of variable in_varid (which can be NC_GLOBAL) in 
+ * group in_gid to variable out_varid in group out_gid, in their native types.
+ * Returns a netCDF error code.
+ */
+static int R_ncu4_copy_atts( int in_gid, int in_varid, int out_gid, int out_varid )
+{
+	int	natts, i, err;
+	char	attname[NC_MAX_NAME+1];
+
+	if( in_varid == NC_GLOBAL )
+		err = nc_inq_natts( in_gid, &natts );
+	else
+		err = nc_inq_varnatts( in_gid, in_varid, &natts );
+	if( err != NC_NOERR )
+		return( err );
+
+	for( i=0; i<natts; i++ ) {
+		err = nc_inq_attname( in_gid, in_varid, i, attname );
+		if( err != NC_NOERR )
+			return( err );
+		err = nc_copy_att( in_gid, in_varid, attname, out_gid, out_varid );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error copying attribute %s: %s\n", attname, nc_strerror(err));
+			return( err );
+			}
+		}
+
+	return( NC_NOERR );
+}
+
+/*********************************************************************************
+ * Copies the global attributes of group in_gid to group out_gid, which must be 
+ * in define mode.  Returns a list with $error.
+ */
+SEXP R_nc4_copy_global_atts( SEXP sx_in_gid, SEXP sx_out_gid )
+{
+	SEXP	sx_retval, sx_retnames;
+	int	err;
+
+	PROTECT( sx_retval = allocVector( VECSXP, 1 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 1 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar( "error" ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = R_ncu4_copy_atts( INTEGER(sx_in_gid)[0], NC_GLOBAL, INTEGER(sx_out_gid)[0], NC_GLOBAL );
+	if( err != NC_NOERR )
+		Rprintf( "Error in R_nc4_copy_global_atts: %s\n", nc_strerror(err));
+	SET_VECTOR_ELT( sx_retval, 0, ScalarInteger( (err == NC_NOERR) ? 0 : -1 ));
+
+	UNPROTECT(2);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Defines a new variable in group out_gid (which must be in define mode) that is a
+ * copy of variable in_varid in group in_gid: same name, same native type, and all
+ * the same attributes.  It uses dims sx_dimids (dimids in the output file, C order).
+ *
+ *	sx_chunks : the chunk sizes (C order); if empty, the netCDF library's default
+ *		storage is used
+ *	sx_deflate: the deflate (compression) level, 1-9, or 0 for no compression
+ *	sx_shuffle: 1 to use the shuffle filter, 0 otherwise
+ *
+ * User-defined types are not supported.  Returns a list with $error and $varid.
+ */
+SEXP R_nc4_copy_var_def( SEXP sx_in_gid, SEXP sx_in_varid, SEXP sx_out_gid, SEXP sx_dimids, 
+	SEXP sx_chunks, SEXP sx_deflate, SEXP sx_shuffle )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_retvarid;
+	int	in_gid, in_varid, out_gid, out_varid, ndims, i, err, dimids[MAX_NC_DIMS], 
+		deflate, shuffle;
+	nc_type	xtype;
+	size_t	chunks[MAX_NC_DIMS];
+	char	varname[NC_MAX_NAME+1];
+
+	in_gid   = INTEGER(sx_in_gid  )[0];
+	in_varid = INTEGER(sx_in_varid)[0];
+	out_gid  = INTEGER(sx_out_gid )[0];
+	deflate  = INTEGER(sx_deflate )[0];
+	shuffle  = INTEGER(sx_shuffle )[0];
+	ndims    = length(sx_dimids);
+
+	PROTECT( sx_retval = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar( "error" ));
+	SET_STRING_ELT( sx_retnames, 1, mkChar( "varid" ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+	PROTECT( sx_retvarid = allocVector( INTSXP, 1 ));
+	INTEGER(sx_retvarid)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 1, sx_retvarid );
+
+	if( ndims > MAX_NC_DIMS ) {
+		Rprintf( "Error in R_nc4_copy_var_def: too many dims: %d\n", ndims );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_var( in_gid, in_varid, varname, &xtype, NULL, NULL, NULL );
+	if( err != NC_NOERR ) {
+		Rprintf( "Error in R_nc4_copy_var_def: %s\n", nc_strerror(err));
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+	if( xtype > NC_STRING ) {
+		Rprintf( "Error in R_nc4_copy_var_def: var %s has a user-defined type, which cannot be copied\n", varname );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	for( i=0; i<ndims; i++ )
+		dimids[i] = INTEGER(sx_dimids)[i];
+	err = nc_def_var( out_gid, varname, xtype, ndims, dimids, &out_varid );
+	if( err != NC_NOERR ) {
+		Rprintf( "Error in R_nc4_copy_var_def defining var %s: %s\n", varname, nc_strerror(err));
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	if( (ndims > 0) && (length(sx_chunks) == ndims)) {
+		for( i=0; i<ndims; i++ )
+			chunks[i] = R_ncu4_sizet_elt( sx_chunks, i );
+		err = nc_def_var_chunking( out_gid, out_varid, NC_CHUNKED, chunks );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_copy_var_def setting chunking of var %s: %s\n", varname, nc_strerror(err));
+			UNPROTECT(3);
+			return( sx_retval );
+			}
+		}
+
+	if( (ndims > 0) && ((deflate > 0) || (shuffle != 0))) {
+		err = nc_def_var_deflate( out_gid, out_varid, shuffle, (deflate > 0), (deflate > 0) ? deflate : 0 );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_copy_var_def setting compression of var %s: %s\n", varname, nc_strerror(err));
+			UNPROTECT(3);
+			return( sx_retval );
+			}
+		}
+
+	err = R_ncu4_copy_atts( in_gid, in_varid, out_gid, out_varid );
+	if( err != NC_NOERR ) {
+		Rprintf( "Error in R_nc4_copy_var_def copying attributes of var %s: %s\n", varname, nc_strerror(err));
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	INTEGER(sx_reterr  )[0] = 0;
+	INTEGER(sx_retvarid)[0] = out_varid;
+	UNPROTECT(3);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Copies the hyperslab (sx_in_start, sx_count) of variable in_varid in group in_gid
+ * to variable out_varid in group out_gid, starting at sx_out_start.  The values 
+ * stay in their native type, so nothing is converted or unpacked.  The copy is done
+ * in blocks of shape sx_block, stepped through as in R_nc4_reduce_double, so with a
+ * block that is a multiple of the chunk sizes each chunk is read (or written) once.
+ * All starts, counts, and block sizes are C order and 0-based.  Returns a list with
+ * $error.
+ */
+SEXP R_nc4_copy_vara( SEXP sx_in_gid, SEXP sx_in_varid, SEXP sx_out_gid, SEXP sx_out_varid, 
+	SEXP sx_in_start, SEXP sx_count, SEXP sx_out_start, SEXP sx_block )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr;
+	int	in_gid, in_varid, out_gid, out_varid, ndims, i, err;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], o_start[MAX_NC_DIMS],
+		b_start[MAX_NC_DIMS], b_count[MAX_NC_DIMS], ob_start[MAX_NC_DIMS], nbuf, nb, elsize;
+	nc_type	xtype;
+	void	*buf;
+
+	in_gid    = INTEGER(sx_in_gid   )[0];
+	in_varid  = INTEGER(sx_in_varid )[0];
+	out_gid   = INTEGER(sx_out_gid  )[0];
+	out_varid = INTEGER(sx_out_varid)[0];
+
+	PROTECT( sx_retval = allocVector( VECSXP, 1 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 1 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar( "error" ));
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	err = nc_inq_varndims( in_gid, in_varid, &ndims );
+	if( err == NC_NOERR )
+		err = nc_inq_vartype( in_gid, in_varid, &xtype );
+	if( err == NC_NOERR )
+		err = nc_inq_type( in_gid, xtype, NULL, &elsize );
+	if( (err != NC_NOERR) || (ndims != length(sx_in_start)) || (ndims != length(sx_count)) 
+			|| (ndims != length(sx_out_start)) || (ndims != length(sx_block))) {
+		Rprintf( "Error in R_nc4_copy_vara: bad ndims or start/count (%s)\n", nc_strerror(err) );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	nbuf = 1L;
+	nb   = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_in_start,  i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count,     i );
+		o_start[i] = R_ncu4_sizet_elt( sx_out_start, i );
+		blk[i]     = R_ncu4_sizet_elt( sx_block,     i );
+		if( blk[i] < 1L        ) blk[i] = 1L;
+		if( blk[i] > s_count[i]) blk[i] = (s_count[i] > 0L) ? s_count[i] : 1L;
+		nbuf *= blk[i];
+		nb   *= s_count[i];
+		}
+	if( nb == 0L ) {
+		INTEGER(sx_reterr)[0] = 0;
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	buf = (void *)R_alloc( nbuf, elsize );
+
+	R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+	do {
+		for( i=0; i<ndims; i++ )
+			ob_start[i] = o_start[i] + (b_start[i] - s_start[i]);
+
+		if( xtype == NC_STRING ) {
+			nb = 1L;
+			for( i=0; i<ndims; i++ )
+				nb *= b_count[i];
+			err = nc_get_vara_string( in_gid, in_varid, b_start, b_count, (char **)buf );
+			if( err == NC_NOERR ) {
+				err = nc_put_vara_string( out_gid, out_varid, ob_start, b_count, (const char **)buf );
+				nc_free_string( nb, (char **)buf );
+				}
+			}
+		else
+			{
+			err = nc_get_vara( in_gid, in_varid, b_start, b_count, buf );
+			if( err == NC_NOERR )
+				err = nc_put_vara( out_gid, out_varid, ob_start, b_count, buf );
+			}
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_copy_vara: %s\n", nc_strerror( err ));
+			UNPROTECT(2);
+			return( sx_retval );
+			}
+
+		R_CheckUserInterrupt();
+		}
+	while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(2);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Write-behind buffer for chunked vars.  Partial writes to a var are gathered
+ * into whole-chunk buffers, and a chunk is written to the file once it has been 
+ * filled, so a compressed chunk is only compressed once instead of being read, 
+ * decompressed and recompressed on every write that touches it.  The buffers 
+ * belong to the root (file) id, and live until R_nc4_wbuf_flush is called.  
+ * When the buffers for a file exceed the memory cap, the least recently written
+ * chunks are written out as they stand.
+ */
+typedef struct R_ncu4_wchunk {
+	size_t		cstart[MAX_NC_DIMS], ccount[MAX_NC_DIMS];
+	size_t		n, ncovered;
+	double		*vals;
+	unsigned char	*covered;
+	unsigned long	seq;
+	struct R_ncu4_wchunk *next;
+} R_ncu4_wchunk;
+
+typedef struct R_ncu4_wvar {
+	int		root, gid, varid, ndims;
+	size_t		chunk[MAX_NC_DIMS], dimlen[MAX_NC_DIMS];	/* dimlen is 0 for unlimited dims */
+	R_ncu4_wchunk	*chunks;
+	struct R_ncu4_wvar *next;
+} R_ncu4_wvar;
+
+static R_ncu4_wvar	*R_ncu4_wbuf_vars = NULL;
+static unsigned long	R_ncu4_wbuf_seq   = 0L;
+
+#define R_NCU4_WCHUNK_BYTES(c) ((c)->n * (sizeof(double) + 1L))
+
+static double R_ncu4_wbuf_bytes( int root )
+{
+	R_ncu4_wvar	*wv;
+	R_ncu4_wchunk	*wc;
+	double		nb;
+
+	nb = 0.0;
+	for( wv=R_ncu4_wbuf_vars; wv != NULL; wv=wv->next ) 
+		if( wv->root == root )
+			for( wc=wv->chunks; wc != NULL; wc=wc->next )
+				nb += (double)R_NCU4_WCHUNK_BYTES(wc);
+
+	return( nb );
+}
+
+/* Writes out whatever part of a chunk has been filled in.  If the filled part is a
+ * box it goes in one write, otherwise each filled run along the last dim is written.
+ */
+static int R_ncu4_wchunk_write( R_ncu4_wvar *wv, R_ncu4_wchunk *wc )
+{
+	int	i, nd, err, isbox;
+	size_t	j, k, off, lo[MAX_NC_DIMS], hi[MAX_NC_DIMS], idx[MAX_NC_DIMS], 
+		bstart[MAX_NC_DIMS], bcount[MAX_NC_DIMS], nbox;
+	double	*buf;
+
+	nd = wv->ndims;
+	if( wc->ncovered == 0 )
+		return( NC_NOERR );
+	if( wc->ncovered == wc->n )
+		return( nc_put_vara_double( wv->gid, wv->varid, wc->cstart, wc->ccount, wc->vals ));
+
+	/* Bounding box of the filled values */
+	for( i=0; i<nd; i++ ) {
+		lo[i] = wc->ccount[i];
+		hi[i] = 0L;
+		idx[i] = 0L;
+		}
+	for( j=0; j<wc->n; j++ ) {
+		if( wc->covered[j] ) 
+			for( i=0; i<nd; i++ ) {
+				if( idx[i] < lo[i] ) lo[i] = idx[i];
+				if( idx[i] > hi[i] ) hi[i] = idx[i];
+				}
+		for( i=nd-1; i>=0; i-- ) {
+			if( ++idx[i] < wc->ccount[i] )
+				break;
+			idx[i] = 0L;
+			}
+		}
+	nbox = 1L;
+	for( i=0; i<nd; i++ ) {
+		bstart[i] = wc->cstart[i] + lo[i];
+		bcount[i] = hi[i] - lo[i] + 1L;
+		nbox     *= bcount[i];
+		}
+	isbox = (nbox == wc->ncovered);
+
+	if( isbox ) {
+		buf = (double *)R_alloc( nbox, sizeof(double) );
+		for( i=0; i<nd; i++ )
+			idx[i] = lo[i];
+		for( j=0; j<nbox; j++ ) {
+			off = 0L;
+			for( i=0; i<nd; i++ )
+				off = off*wc->ccount[i] + idx[i];
+			buf[j] = wc->vals[off];
+			for( i=nd-1; i>=0; i-- ) {
+				if( ++idx[i] <= hi[i] )
+					break;
+				idx[i] = lo[i];
+				}
+			}
+		return( nc_put_vara_double( wv->gid, wv->varid, bstart, bcount, buf ));
+		}
+
+	/* Not a box; write each filled run along the last dim */
+	for( i=0; i<nd; i++ ) {
+		idx[i]    = 0L;
+		bcount[i] = 1L;
+		}
+	j = 0L;
+	while( j < wc->n ) {
+		if( ! wc->covered[j] ) {
+			j++;
+			continue;
+			}
+		for( k=j; (k < wc->n) && wc->covered[k] && ((k == j) || (k % wc->ccount[nd-1] != 0L)); k++ )
+			;
+		off = j;
+		for( i=nd-1; i>=0; i-- ) {
+			bstart[i] = wc->cstart[i] + off % wc->ccount[i];
+			off /= wc->ccount[i];
+			}
+		bcount[nd-1] = k - j;
+		err = nc_put_vara_double( wv->gid, wv->varid, bstart, bcount, wc->vals + j );
+		if( err != NC_NOERR )
+			return( err );
+		j = k;
+		}
+
+	return( NC_NOERR );
+}
+
+static void R_ncu4_wchunk_free( R_ncu4_wchunk *wc )
+{
+	free( wc->vals );
+	free( wc->covered );
+	free( wc );
+}
+
+/* Writes out and drops one chunk of a var */
+static int R_ncu4_wchunk_drop( R_ncu4_wvar *wv, R_ncu4_wchunk *wc )
+{
+	R_ncu4_wchunk	**pp;
+	int		err;
+
+	err = R_ncu4_wchunk_write( wv, wc );
+	for( pp=&(wv->chunks); *pp != NULL; pp=&((*pp)->next) )
+		if( *pp == wc ) {
+			*pp = wc->next;
+			break;
+			}
+	R_ncu4_wchunk_free( wc );
+
+	return( err );
+}
+
+/* Writes out least recently written chunks of the file until 'need' more bytes fit under 'maxbytes' */
+static int R_ncu4_wbuf_evict( int root, double need, double maxbytes )
+{
+	R_ncu4_wvar	*wv, *oldv;
+	R_ncu4_wchunk	*wc, *oldc;
+	double		nb;
+	int		err;
+
+	nb = R_ncu4_wbuf_bytes( root );
+	while( nb + need > maxbytes ) {
+		oldv = NULL;
+		oldc = NULL;
+		for( wv=R_ncu4_wbuf_vars; wv != NULL; wv=wv->next ) 
+			if( wv->root == root )
+				for( wc=wv->chunks; wc != NULL; wc=wc->next )
+					if( (oldc == NULL) || (wc->seq < oldc->seq)) {
+						oldv = wv;
+						oldc = wc;
+						}
+		if( oldc == NULL )
+			break;
+		nb -= (double)R_NCU4_WCHUNK_BYTES(oldc);
+		err = R_ncu4_wchunk_drop( oldv, oldc );
+		if( err != NC_NOERR )
+			return( err );
+		}
+
+	return( NC_NOERR );
+}
+
+/*********************************************************************************
+ * Buffers a write of 'vals' to hyperslab (start, count) of a chunked var.  start, 
+ * count, chunks and dimlen are in C order; dimlen is 0 for unlimited dims.  Chunks 
+ * that become full are written immediately.  Returns 0 on success, -1 on error.
+ */
+SEXP R_nc4_wbuf_put( SEXP sx_root, SEXP sx_gid, SEXP sx_varid, SEXP sx_start, SEXP sx_count,
+	SEXP sx_chunks, SEXP sx_dimlen, SEXP sx_vals, SEXP sx_maxbytes )
+{
+	int		root, gid, varid, ndims, i, err;
+	size_t		s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], b_start[MAX_NC_DIMS], b_count[MAX_NC_DIMS],
+			idx[MAX_NC_DIMS], j, nrows, soff, coff, nlast, nb;
+	double		maxbytes, *vals;
+	R_ncu4_wvar	*wv;
+	R_ncu4_wchunk	*wc;
+	SEXP		sx_retval;
+
+	root     = INTEGER(sx_root)[0];
+	gid      = INTEGER(sx_gid)[0];
+	varid    = INTEGER(sx_varid)[0];
+	ndims    = length(sx_start);
+	maxbytes = REAL(sx_maxbytes)[0];
+	vals     = REAL(sx_vals);
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	PROTECT( sx_retval = NEW_NUMERIC(1));
+	NUMERIC_POINTER(sx_retval)[0] = -1;
+
+	if( (ndims < 1) || (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims) || 
+	    (length(sx_chunks) != ndims) || (length(sx_dimlen) != ndims)) {
+		Rprintf( "Error in R_nc4_wbuf_put: bad number of dims (%d)\n", ndims );
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+
+	for( wv=R_ncu4_wbuf_vars; wv != NULL; wv=wv->next )
+		if( (wv->root == root) && (wv->gid == gid) && (wv->varid == varid))
+			break;
+	if( wv == NULL ) {
+		wv = (R_ncu4_wvar *)calloc( 1, sizeof(R_ncu4_wvar) );
+		if( wv == NULL ) {
+			Rprintf( "Error in R_nc4_wbuf_put: out of memory\n" );
+			UNPROTECT(1);
+			return( sx_retval );
+			}
+		wv->root  = root;
+		wv->gid   = gid;
+		wv->varid = varid;
+		wv->ndims = ndims;
+		for( i=0; i<ndims; i++ ) {
+			wv->chunk[i]  = R_ncu4_sizet_elt( sx_chunks, i );
+			wv->dimlen[i] = R_ncu4_sizet_elt( sx_dimlen, i );
+			if( wv->chunk[i] < 1L ) 
+				wv->chunk[i] = 1L;
+			}
+		wv->next = R_ncu4_wbuf_vars;
+		R_ncu4_wbuf_vars = wv;
+		}
+
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		if( s_count[i] == 0L ) {
+			NUMERIC_POINTER(sx_retval)[0] = 0;
+			UNPROTECT(1);
+			return( sx_retval );
+			}
+		}
+
+	/* Each block is the part of the write that falls in one chunk */
+	R_ncu4_block_first( ndims, s_start, s_count, wv->chunk, b_start, b_count );
+	do {
+		for( wc=wv->chunks; wc != NULL; wc=wc->next ) {
+			for( i=0; i<ndims; i++ )
+				if( b_start[i] - wc->cstart[i] >= wc->ccount[i] )	/* unsigned, so also catches b_start < cstart */
+					break;
+			if( i == ndims )
+				break;
+			}
+
+		if( wc == NULL ) {
+			nb = 1L;
+			for( i=0; i<ndims; i++ )
+				nb *= (wv->dimlen[i] == 0L) ? wv->chunk[i] : 
+					(((b_start[i]/wv->chunk[i])*wv->chunk[i] + wv->chunk[i] > wv->dimlen[i]) ?
+					 wv->dimlen[i] - (b_start[i]/wv->chunk[i])*wv->chunk[i] : wv->chunk[i]);
+			err = R_ncu4_wbuf_evict( root, (double)nb * (sizeof(double) + 1L), maxbytes );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_wbuf_put: %s\n", nc_strerror( err ));
+				UNPROTECT(1);
+				return( sx_retval );
+				}
+			wc = (R_ncu4_wchunk *)calloc( 1, sizeof(R_ncu4_wchunk) );
+			if( wc != NULL ) {
+				wc->vals    = (double *)malloc( nb * sizeof(double) );
+				wc->covered = (unsigned char *)calloc( nb, 1 );
+				}
+			if( (wc == NULL) || (wc->vals == NULL) || (wc->covered == NULL)) {
+				if( wc != NULL ) 
+					R_ncu4_wchunk_free( wc );
+				Rprintf( "Error in R_nc4_wbuf_put: out of memory for a chunk buffer of %lu values\n", 
+					(unsigned long)nb );
+				UNPROTECT(1);
+				return( sx_retval );
+				}
+			wc->n = nb;
+			for( i=0; i<ndims; i++ ) {
+				wc->cstart[i] = (b_start[i]/wv->chunk[i])*wv->chunk[i];
+				wc->ccount[i] = wv->chunk[i];
+				if( (wv->dimlen[i] != 0L) && (wc->cstart[i] + wc->ccount[i] > wv->dimlen[i]))
+					wc->ccount[i] = wv->dimlen[i] - wc->cstart[i];
+				}
+			wc->next   = wv->chunks;
+			wv->chunks = wc;
+			}
+		wc->seq = ++R_ncu4_wbuf_seq;
+
+		/* Copy the block in, one run along the last dim at a time */
+		nlast = b_count[ndims-1];
+		nrows = 1L;
+		for( i=0; i<ndims-1; i++ ) {
+			nrows *= b_count[i];
+			idx[i] = 0L;
+			}
+		for( j=0; j<nrows; j++ ) {
+			soff = 0L;
+			coff = 0L;
+			for( i=0; i<ndims-1; i++ ) {
+				soff = soff*s_count[i]   + (b_start[i] + idx[i] - s_start[i]);
+				coff = coff*wc->ccount[i] + (b_start[i] + idx[i] - wc->cstart[i]);
+				}
+			soff = soff*s_count[ndims-1]    + (b_start[ndims-1] - s_start[ndims-1]);
+			coff = coff*wc->ccount[ndims-1] + (b_start[ndims-1] - wc->cstart[ndims-1]);
+
+			memcpy( wc->vals + coff, vals + soff, nlast*sizeof(double) );
+			for( nb=0L; nb<nlast; nb++ ) 
+				if( ! wc->covered[coff+nb] ) {
+					wc->covered[coff+nb] = 1;
+					wc->ncovered++;
+					}
+
+			for( i=ndims-2; i>=0; i-- ) {
+				if( ++idx[i] < b_count[i] )
+					break;
+				idx[i] = 0L;
+				}
+			}
+
+		if( wc->ncovered == wc->n ) {
+			err = R_ncu4_wchunk_drop( wv, wc );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_wbuf_put: %s\n", nc_strerror( err ));
+				UNPROTECT(1);
+				return( sx_retval );
+				}
+			}
+		}
+	while( R_ncu4_block_next( ndims, s_start, s_count, wv->chunk, b_start, b_count ));
+
+	NUMERIC_POINTER(sx_retval)[0] = 0;
+	UNPROTECT(1);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Writes out everything buffered for a file and frees the buffers.  All the 
+ * chunks are written and freed even if one fails.  Returns 0 on success, -1 on 
+ * error.
+ */
+SEXP R_nc4_wbuf_flush( SEXP sx_root )
+{
+	int		root, err, ierr;
+	R_ncu4_wvar	**pv, *wv;
+	SEXP		sx_retval;
+
+	root = INTEGER(sx_root)[0];
+	ierr = NC_NOERR;
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	pv = &R_ncu4_wbuf_vars;
+	while( *pv != NULL ) {
+		wv = *pv;
+		if( wv->root != root ) {
+			pv = &(wv->next);
+			continue;
+			}
+		while( wv->chunks != NULL ) {
+			err = R_ncu4_wchunk_drop( wv, wv->chunks );
+			if( err != NC_NOERR ) {
+				Rprintf( "Error in R_nc4_wbuf_flush: %s\n", nc_strerror( err ));
+				ierr = err;
+				}
+			}
+		*pv = wv->next;
+		free( wv );
+		}
+
+	PROTECT( sx_retval = NEW_NUMERIC(1));
+	NUMERIC_POINTER(sx_retval)[0] = (ierr == NC_NOERR) ? 0 : -1;
+	UNPROTECT(1);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Background writes.  ncvar_put(..., async=TRUE) copies the values into a job 
+ * that is queued for a single I/O thread, which does the nc_put_vara_* calls 
+ * while R goes on.  The netCDF library is not thread safe, so the R side must 
+ * not call into the library while jobs are pending; R_nc4_async_wait is called 
+ * first by everything in the package that touches a file, and the .Call routines
+ * that use the library wait again themselves (R_ncu4_async_drain).  The worker must not 
+ * call the R API, so an error is only recorded (the first one for each file) 
+ * and handed back by R_nc4_async_wait.  The same thread does the read-ahead 
+ * for ncvar_iter (R_nc4_iter_open, below).
+ */
+struct R_ncu4_iter;
+
+typedef struct R_ncu4_ajob {
+	int		root, gid, varid, ndims, isint;
+	size_t		start[MAX_NC_DIMS], count[MAX_NC_DIMS];
+	void		*data;
+	struct R_ncu4_iter *iter;	/* set for a read-ahead job (see R_nc4_iter_open) */
+	int		slot;
+	struct R_ncu4_ajob *next;
+} R_ncu4_ajob;
+
+typedef struct R_ncu4_aerr {
+	int		root, gid, varid, err;
+	struct R_ncu4_aerr *next;
+} R_ncu4_aerr;
+
+static pthread_mutex_t	R_ncu4_async_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	R_ncu4_async_hasjob  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	R_ncu4_async_jobdone = PTHREAD_COND_INITIALIZER;
+static R_ncu4_ajob	*R_ncu4_async_head = NULL, *R_ncu4_async_tail = NULL;
+static R_ncu4_aerr	*R_ncu4_async_errs = NULL;
+static int		R_ncu4_async_npending = 0;	/* queued plus the one being written */
+static int		R_ncu4_async_started  = 0;
+
+/* Waits until the I/O thread has done everything queued, writes and read-ahead
+ * alike.  Every .Call routine that uses the library from the R thread calls this
+ * first, so that nothing depends on the R code having waited.
+ */
+static void R_ncu4_async_drain( void )
+{
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	while( R_ncu4_async_npending > 0 )
+		pthread_cond_wait( &R_ncu4_async_jobdone, &R_ncu4_async_mutex );
+	pthread_mutex_unlock( &R_ncu4_async_mutex );
+}
+
+static int R_ncu4_iter_read( R_ncu4_ajob *job );
+static void R_ncu4_iter_done( R_ncu4_ajob *job, int err );
+
+static void *R_ncu4_async_worker( void *arg )
+{
+	R_ncu4_ajob	*job;
+	R_ncu4_aerr	*ae;
+	int		err;
+
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	for( ;; ) {
+		while( R_ncu4_async_head == NULL )
+			pthread_cond_wait( &R_ncu4_async_hasjob, &R_ncu4_async_mutex );
+		job = R_ncu4_async_head;
+		R_ncu4_async_head = job->next;
+		if( R_ncu4_async_head == NULL )
+			R_ncu4_async_tail = NULL;
+		pthread_mutex_unlock( &R_ncu4_async_mutex );
+
+		if( job->iter != NULL )
+			err = R_ncu4_iter_read( job );
+		else if( job->isint )
+			err = nc_put_vara_int( job->gid, job->varid, job->start, job->count, (int *)job->data );
+		else
+			err = nc_put_vara_double( job->gid, job->varid, job->start, job->count, (double *)job->data );
+		free( job->data );
+
+		pthread_mutex_lock( &R_ncu4_async_mutex );
+		if( job->iter != NULL )
+			R_ncu4_iter_done( job, err );
+		else if( err != NC_NOERR ) {
+			for( ae=R_ncu4_async_errs; ae != NULL; ae=ae->next )
+				if( ae->root == job->root )
+					break;
+			if( (ae == NULL) && ((ae = (R_ncu4_aerr *)malloc( sizeof(R_ncu4_aerr) )) != NULL)) {
+				ae->root  = job->root;
+				ae->gid   = job->gid;
+				ae->varid = job->varid;
+				ae->err   = err;
+				ae->next  = R_ncu4_async_errs;
+				R_ncu4_async_errs = ae;
+				}
+			}
+		free( job );
+		R_ncu4_async_npending--;
+		pthread_cond_broadcast( &R_ncu4_async_jobdone );
+		}
+
+	return( NULL );
+}
+
+/* Puts a job on the queue, starting the I/O thread the first time.  If maxqueue 
+ * is > 0 and that many jobs are already pending, this waits for one to finish.
+ * Returns 0 on success, -1 if the I/O thread could not be started.
+ */
+static int R_ncu4_async_enqueue( R_ncu4_ajob *job, int maxqueue )
+{
+	pthread_t	thread;
+
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	if( ! R_ncu4_async_started ) {
+		if( pthread_create( &thread, NULL, R_ncu4_async_worker, NULL ) != 0 ) {
+			pthread_mutex_unlock( &R_ncu4_async_mutex );
+			return( -1 );
+			}
+		pthread_detach( thread );
+		R_ncu4_async_started = 1;
+		}
+
+	/* Back-pressure: wait for room in the queue */
+	while( (maxqueue > 0) && (R_ncu4_async_npending >= maxqueue))
+		pthread_cond_wait( &R_ncu4_async_jobdone, &R_ncu4_async_mutex );
+
+	job->next = NULL;
+	if( R_ncu4_async_tail == NULL )
+		R_ncu4_async_head = job;
+	else
+		R_ncu4_async_tail->next = job;
+	R_ncu4_async_tail = job;
+	R_ncu4_async_npending++;
+	pthread_cond_signal( &R_ncu4_async_hasjob );
+	pthread_mutex_unlock( &R_ncu4_async_mutex );
+
+	return( 0 );
+}
+
+/*********************************************************************************
+ * Queues a write of 'vals' (integer or double) to hyperslab (start, count) of a
+ * var.  start and count are in C order.  If 'maxqueue' writes are already 
+ * pending, this waits until one of them is done.  Returns 0 on success, -1 if 
+ * the write could not be queued.
+ */
+SEXP R_nc4_async_put( SEXP sx_root, SEXP sx_gid, SEXP sx_varid, SEXP sx_start, SEXP sx_count,
+	SEXP sx_vals, SEXP sx_maxqueue )
+{
+	int		i, maxqueue;
+	size_t		n, nb;
+	R_ncu4_ajob	*job;
+	SEXP		sx_retval;
+
+	PROTECT( sx_retval = NEW_NUMERIC(1));
+	NUMERIC_POINTER(sx_retval)[0] = -1;
+
+	maxqueue = INTEGER(sx_maxqueue)[0];
+	if( maxqueue < 1 )
+		maxqueue = 1;
+
+	job = (R_ncu4_ajob *)calloc( 1, sizeof(R_ncu4_ajob) );
+	if( job == NULL ) {
+		Rprintf( "Error in R_nc4_async_put: out of memory\n" );
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+	job->root  = INTEGER(sx_root)[0];
+	job->gid   = INTEGER(sx_gid)[0];
+	job->varid = INTEGER(sx_varid)[0];
+	job->ndims = length(sx_start);
+	job->isint = (TYPEOF(sx_vals) == INTSXP);
+	if( job->ndims > MAX_NC_DIMS ) {
+		Rprintf( "Error in R_nc4_async_put: too many dims (%d)\n", job->ndims );
+		free( job );
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+
+	n = 1L;
+	for( i=0; i<job->ndims; i++ ) {
+		job->start[i] = R_ncu4_sizet_elt( sx_start, i );
+		job->count[i] = R_ncu4_sizet_elt( sx_count, i );
+		n *= job->count[i];
+		}
+	if( (size_t)xlength(sx_vals) < n ) {
+		Rprintf( "Error in R_nc4_async_put: %lu values were passed to write %lu\n", 
+			(unsigned long)xlength(sx_vals), (unsigned long)n );
+		free( job );
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+
+	/* R may free or change 'vals' after we return, so the job gets its own copy */
+	nb = n * (job->isint ? sizeof(int) : sizeof(double));
+	job->data = malloc( (nb > 0L) ? nb : 1L );
+	if( job->data == NULL ) {
+		Rprintf( "Error in R_nc4_async_put: out of memory for a write of %lu values\n", (unsigned long)n );
+		free( job );
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+	if( job->isint )
+		memcpy( job->data, INTEGER(sx_vals), nb );
+	else
+		memcpy( job->data, REAL(sx_vals), nb );
+
+	if( R_ncu4_async_enqueue( job, maxqueue ) != 0 ) {
+		Rprintf( "Error in R_nc4_async_put: could not start the I/O thread\n" );
+		free( job->data );
+		free( job );
+		UNPROTECT(1);
+		return( sx_retval );
+		}
+
+	NUMERIC_POINTER(sx_retval)[0] = 0;
+	UNPROTECT(1);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Waits until all the queued writes (for every file, since the library must be
+ * idle before R can use it again) are done.  Returns the empty string, or a
+ * message describing the first write to file 'root' that failed since the last
+ * call, which is then forgotten.  Pass root=-1 to just wait.
+ */
+SEXP R_nc4_async_wait( SEXP sx_root )
+{
+	int		root;
+	char		msg[MAX_NC_NAME + 256], varname[MAX_NC_NAME];
+	R_ncu4_aerr	**pe, *ae;
+	SEXP		sx_retval;
+
+	root = INTEGER(sx_root)[0];
+	msg[0] = '\0';
+
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	while( R_ncu4_async_npending > 0 )
+		pthread_cond_wait( &R_ncu4_async_jobdone, &R_ncu4_async_mutex );
+
+	for( pe=&R_ncu4_async_errs; *pe != NULL; pe=&((*pe)->next) )
+		if( (*pe)->root == root ) {
+			ae  = *pe;
+			*pe = ae->next;
+			if( nc_inq_varname( ae->gid, ae->varid, varname ) != NC_NOERR )
+				strcpy( varname, "(unknown)" );
+			snprintf( msg, sizeof(msg), "background write to var %s failed: %s", 
+				varname, nc_strerror( ae->err ));
+			free( ae );
+			break;
+			}
+	pthread_mutex_unlock( &R_ncu4_async_mutex );
+
+	PROTECT( sx_retval = allocVector( STRSXP, 1 ));
+	SET_STRING_ELT( sx_retval, 0, mkChar( msg ));
+	UNPROTECT(1);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Read-ahead iteration along one dim of a var.  The hyperslab (start, count) is
+ * stepped through 'by' indices at a time along dim 'along' (C order).  Up to 
+ * 'nslot' steps are read ahead by the I/O thread into a ring of buffers, with 
+ * missing values set to NA and the scale factor and offset applied, so that 
+ * while R works on one step the next ones are being read and decompressed.
+ */
+#define R_NCU4_SLOT_FREE	0
+#define R_NCU4_SLOT_READING	1
+#define R_NCU4_SLOT_READY	2
+
+typedef struct R_ncu4_iter {
+	int		gid, varid, ndims, along, nslot, imvstate;
+	size_t		start[MAX_NC_DIMS], count[MAX_NC_DIMS], by, nsteps, nissued, nreturned, nmax;
+	double		missval, mvtol, scale, offset, na;
+	double		**buf;
+	int		*state, *err;
+} R_ncu4_iter;
+
+/* The slab read at step 'step' */
+static void R_ncu4_iter_slab( R_ncu4_iter *it, size_t step, size_t *s_start, size_t *s_count )
+{
+	int	i;
+
+	for( i=0; i<it->ndims; i++ ) {
+		s_start[i] = it->start[i];
+		s_count[i] = it->count[i];
+		}
+	s_start[it->along] = it->start[it->along] + step*it->by;
+	s_count[it->along] = it->by;
+	if( s_start[it->along] + s_count[it->along] > it->start[it->along] + it->count[it->along] )
+		s_count[it->along] = it->start[it->along] + it->count[it->along] - s_start[it->along];
+}
+
+/* Runs on the I/O thread, so must not use the R API */
+static int R_ncu4_iter_read( R_ncu4_ajob *job )
+{
+	R_ncu4_iter	*it;
+	double		*buf, v;
+	size_t		k, n;
+	int		i, err;
+
+	it  = job->iter;
+	buf = it->buf[ job->slot ];
+	err = nc_get_vara_double( job->gid, job->varid, job->start, job->count, buf );
+	if( err != NC_NOERR )
+		return( err );
+
+	n = 1L;
+	for( i=0; i<job->ndims; i++ )
+		n *= job->count[i];
+	for( k=0; k<n; k++ ) {
+		v = buf[k];
+		if( (it->imvstate == 2) && R_ncu4_ismissval( v, it->missval, it->mvtol ))
+			buf[k] = it->na;
+		else if( ! ISNAN(v))
+			buf[k] = v*it->scale + it->offset;
+		}
+
+	return( NC_NOERR );
+}
+
+/* Called with the queue mutex held */
+static void R_ncu4_iter_done( R_ncu4_ajob *job, int err )
+{
+	job->iter->err  [ job->slot ] = err;
+	job->iter->state[ job->slot ] = R_NCU4_SLOT_READY;
+}
+
+/* Queues the read of the next step into the free slot it goes in */
+static int R_ncu4_iter_issue( R_ncu4_iter *it )
+{
+	R_ncu4_ajob	*job;
+	int		slot;
+
+	slot = (int)(it->nissued % (size_t)it->nslot);
+	job  = (R_ncu4_ajob *)calloc( 1, sizeof(R_ncu4_ajob) );
+	if( job == NULL )
+		return( -1 );
+	job->gid   = it->gid;
+	job->varid = it->varid;
+	job->ndims = it->ndims;
+	job->iter  = it;
+	job->slot  = slot;
+	R_ncu4_iter_slab( it, it->nissued, job->start, job->count );
+
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	it->state[slot] = R_NCU4_SLOT_READING;
+	pthread_mutex_unlock( &R_ncu4_async_mutex );
+
+	if( R_ncu4_async_enqueue( job, 0 ) != 0 ) {
+		it->state[slot] = R_NCU4_SLOT_FREE;
+		free( job );
+		return( -1 );
+		}
+	it->nissued++;
+
+	return( 0 );
+}
+
+static void R_ncu4_iter_free( R_ncu4_iter *it )
+{
+	int	i;
+
+	/* The I/O thread may still be reading into our buffers */
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	for( i=0; i<it->nslot; i++ )
+		while( it->state[i] == R_NCU4_SLOT_READING )
+			pthread_cond_wait( &R_ncu4_async_jobdone, &R_ncu4_async_mutex );
+	pthread_mutex_unlock( &R_ncu4_async_mutex );
+
+	for( i=0; i<it->nslot; i++ )
+		free( it->buf[i] );
+	free( it->buf );
+	free( it->state );
+	free( it->err );
+	free( it );
+}
+
+static void R_ncu4_iter_finalizer( SEXP sx_iter )
+{
+	R_ncu4_iter	*it;
+
+	it = (R_ncu4_iter *)R_ExternalPtrAddr( sx_iter );
+	if( it == NULL )
+		return;
+	R_ncu4_iter_free( it );
+	R_ClearExternalPtr( sx_iter );
+}
+
+/*********************************************************************************
+ * Starts a read-ahead iteration.  start and count are in C order, and 'along' 
+ * is a C-order dim index.  imvstate, missval are as in Rsx_nc4_get_vara_double.
+ * Returns list(error, iter), where iter is an external pointer for 
+ * R_nc4_iter_next.
+ */
+SEXP R_nc4_iter_open( SEXP sx_gid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, SEXP sx_along,
+	SEXP sx_by, SEXP sx_nslot, SEXP sx_imvstate, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset )
+{
+	R_ncu4_iter	*it;
+	int		i, ok;
+	size_t		n;
+	SEXP		sx_retval, sx_retnames, sx_reterr, sx_iter;
+
+	PROTECT( sx_retval   = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("iter") );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	it = (R_ncu4_iter *)calloc( 1, sizeof(R_ncu4_iter) );
+	if( it == NULL ) {
+		Rprintf( "Error in R_nc4_iter_open: out of memory\n" );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+	it->gid      = INTEGER(sx_gid)[0];
+	it->varid    = INTEGER(sx_varid)[0];
+	it->ndims    = length(sx_start);
+	it->along    = INTEGER(sx_along)[0];
+	it->by       = R_ncu4_sizet_elt( sx_by, 0 );
+	it->nslot    = INTEGER(sx_nslot)[0];
+	it->imvstate = INTEGER(sx_imvstate)[0];
+	it->missval  = REAL(sx_missval)[0];
+	it->mvtol    = R_ncu4_mvtol( INTEGER(sx_precint)[0], it->missval );
+	it->scale    = REAL(sx_scale)[0];
+	it->offset   = REAL(sx_offset)[0];
+	it->na       = NA_REAL;
+	if( (it->ndims < 1) || (it->ndims > MAX_NC_DIMS) || (it->along < 0) || (it->along >= it->ndims) ||
+	    (it->by < 1L) || (it->nslot < 1)) {
+		Rprintf( "Error in R_nc4_iter_open: bad arguments\n" );
+		free( it );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	n = 1L;
+	for( i=0; i<it->ndims; i++ ) {
+		it->start[i] = R_ncu4_sizet_elt( sx_start, i );
+		it->count[i] = R_ncu4_sizet_elt( sx_count, i );
+		if( i != it->along )
+			n *= it->count[i];
+		}
+	it->nsteps = (it->count[it->along] + it->by - 1L) / it->by;
+	it->nmax   = n * it->by;
+
+	ok = ((it->buf   = (double **)calloc( it->nslot, sizeof(double *) )) != NULL) &&
+	     ((it->state = (int *)calloc( it->nslot, sizeof(int) )) != NULL) &&
+	     ((it->err   = (int *)calloc( it->nslot, sizeof(int) )) != NULL);
+	for( i=0; ok && (i<it->nslot); i++ )
+		ok = ((it->buf[i] = (double *)malloc( ((it->nmax > 0L) ? it->nmax : 1L) * sizeof(double) )) != NULL);
+	if( ! ok ) {
+		Rprintf( "Error in R_nc4_iter_open: out of memory for %d buffers of %lu values\n", 
+			it->nslot, (unsigned long)it->nmax );
+		if( it->buf != NULL ) {
+			for( i=0; i<it->nslot; i++ )
+				free( it->buf[i] );
+			free( it->buf );
+			}
+		free( it->state );
+		free( it->err );
+		free( it );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	PROTECT( sx_iter = R_MakeExternalPtr( it, R_NilValue, R_NilValue ));
+	R_RegisterCFinalizerEx( sx_iter, R_ncu4_iter_finalizer, TRUE );
+	SET_VECTOR_ELT( sx_retval, 1, sx_iter );
+
+	while( (it->nissued < it->nsteps) && (it->nissued < (size_t)it->nslot))
+		if( R_ncu4_iter_issue( it ) != 0 ) {
+			Rprintf( "Error in R_nc4_iter_open: could not start the read-ahead\n" );
+			UNPROTECT(4);
+			return( sx_retval );
+			}
+
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(4);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Returns the next step of an iteration as list(error, step, count, data).  step 
+ * is 0-based; count is the number of indices along the iterated dim in this step
+ * (the last one can be short); data is NULL when there are no more steps.  The 
+ * read of a later step is queued in place of this one.
+ */
+SEXP R_nc4_iter_next( SEXP sx_iter )
+{
+	R_ncu4_iter	*it;
+	int		slot, err;
+	size_t		step, n, s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS];
+	SEXP		sx_retval, sx_retnames, sx_reterr, sx_data;
+
+	PROTECT( sx_retval   = allocVector( VECSXP, 4 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 4 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("step") );
+	SET_STRING_ELT( sx_retnames, 2, mkChar("count") );
+	SET_STRING_ELT( sx_retnames, 3, mkChar("data") );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	it = (R_ncu4_iter *)R_ExternalPtrAddr( sx_iter );
+	if( it == NULL ) {
+		Rprintf( "Error in R_nc4_iter_next: the iteration has been freed\n" );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	step = it->nreturned;
+	SET_VECTOR_ELT( sx_retval, 1, ScalarReal( (double)step ));
+	if( step >= it->nsteps ) {
+		INTEGER(sx_reterr)[0] = 0;
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	if( step >= it->nissued ) {
+		Rprintf( "Error in R_nc4_iter_next: the read of step %lu could not be queued\n", (unsigned long)step );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	slot = (int)(step % (size_t)it->nslot);
+	pthread_mutex_lock( &R_ncu4_async_mutex );
+	while( it->state[slot] != R_NCU4_SLOT_READY )
+		pthread_cond_wait( &R_ncu4_async_jobdone, &R_ncu4_async_mutex );
+	err = it->err[slot];
+	pthread_mutex_unlock( &R_ncu4_async_mutex );
+
+	R_ncu4_iter_slab( it, step, s_start, s_count );
+	n = it->nmax / it->by * s_count[it->along];
+	SET_VECTOR_ELT( sx_retval, 2, ScalarReal( (double)s_count[it->along] ));
+
+	if( err == NC_NOERR ) {
+		PROTECT( sx_data = allocVector( REALSXP, n ));
+		memcpy( REAL(sx_data), it->buf[slot], n*sizeof(double) );
+		SET_VECTOR_ELT( sx_retval, 3, sx_data );
+		UNPROTECT(1);
+		}
+	else
+		Rprintf( "Error in R_nc4_iter_next: %s\n", nc_strerror( err ));
+
+	it->state[slot] = R_NCU4_SLOT_FREE;
+	it->nreturned++;
+	if( it->nissued < it->nsteps )
+		R_ncu4_iter_issue( it );
+
+	if( err == NC_NOERR )
+		INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(3);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Parallel read of one hyperslab.  The hyperslab is split into pieces along dim 
+ * 'split' (C order); every dim before it must have a count of 1, so each piece is
+ * a contiguous part of the result.  Each piece is read by a forked worker process
+ * that opens the file itself (read only) and reads straight into a shared 
+ * anonymous mapping, which then becomes the result.  The values are the same as
+ * from Rsx_nc4_get_vara_int (isint=1) or Rsx_nc4_get_vara_double (isint=0) with
+ * the same byte_style, fixmiss, imvstate and missval.  pstart and pcount give 
+ * each piece's start (0-based) and count along the split dim.  Returns 
+ * list(error, data).  Not available on Windows.
+ */
+#ifndef _WIN32
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Waits for forked worker 'pid', retrying only if a signal interrupts the wait.
+ * Returns 0 if the worker exited with status 0, or -1 if it did not or could not
+ * be waited for.
+ */
+static int R_ncu4_wait_child( pid_t pid )
+{
+	int	status;
+
+	while( waitpid( pid, &status, 0 ) < 0 )
+		if( errno != EINTR )
+			return( -1 );
+
+	return( (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -1 );
+}
+
+/* Finds a var by its fully qualified name (group/subgroup/var), without the R API */
+static int R_ncu4_varid_by_name( int ncid, const char *name, int *gid, int *varid )
+{
+	char		gname[MAX_NC_NAME+1];
+	const char	*slash;
+	size_t		len;
+	int		err;
+
+	*gid = ncid;
+	while( (slash = strchr( name, '/' )) != NULL ) {
+		len = (size_t)(slash - name);
+		if( len > MAX_NC_NAME )
+			return( NC_EMAXNAME );
+		strncpy( gname, name, len );
+		gname[len] = '\0';
+		if( (err = nc_inq_grp_ncid( *gid, gname, gid )) != NC_NOERR )
+			return( err );
+		name = slash + 1;
+		}
+
+	return( nc_inq_varid( *gid, name, varid ));
+}
+
+/* Runs in the worker process, so must not use the R API */
+static int R_ncu4_par_read_piece( const char *filename, const char *varname, int ndims, 
+	size_t *s_start, size_t *s_count, int isint, int byte_style, int fixmiss, int imvstate, 
+	double missval, void *out )
+{
+	int	ncid, gid, varid, err, i, *ip;
+	size_t	k, n;
+	double	*dp, mvtol;
+	nc_type	nct;
+
+	if( (err = nc_open( filename, NC_NOWRITE, &ncid )) != NC_NOERR )
+		return( err );
+	err = R_ncu4_varid_by_name( ncid, varname, &gid, &varid );
+	if( err == NC_NOERR ) {
+		if( isint )
+			err = nc_get_vara_int( gid, varid, s_start, s_count, (int *)out );
+		else
+			err = nc_get_vara_double( gid, varid, s_start, s_count, (double *)out );
+		}
+	if( err == NC_NOERR ) {
+		n = 1L;
+		for( i=0; i<ndims; i++ )
+			n *= s_count[i];
+		if( isint && (byte_style == 2) && (nc_inq_vartype( gid, varid, &nct ) == NC_NOERR) && (nct == NC_BYTE)) {
+			ip = (int *)out;
+			for( k=0L; k<n; k++ )
+				if( ip[k] < 0 )
+					ip[k] += 256;
+			}
+		if( (! isint) && (fixmiss == 1) && (imvstate == 2)) {
+			dp    = (double *)out;
+			mvtol = (missval == 0.0) ? 1.e-10 : fabs( missval ) * 1.e-5;
+			for( k=0L; k<n; k++ )
+				if( fabs( dp[k] - missval ) < mvtol )
+					dp[k] = NA_REAL;
+			}
+		}
+	nc_close( ncid );
+
+	return( err );
+}
+#endif
+
+SEXP R_nc4_get_vara_par( SEXP sx_filename, SEXP sx_varname, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_isint, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_imvstate, SEXP sx_missval,
+	SEXP sx_split, SEXP sx_pstart, SEXP sx_pcount )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_data;
+#ifndef _WIN32
+	int	ndims, split, isint, byte_style, fixmiss, imvstate, npieces, ip, i, nfailed;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], n, nb, esize, inner, off;
+	double	missval;
+	char	*shared;
+	pid_t	*pids;
+	const char *filename, *varname;
+#endif
+
+	PROTECT( sx_retval   = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("data") );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+#ifdef _WIN32
+	Rprintf( "Error in R_nc4_get_vara_par: parallel reads are not available on Windows\n" );
+	UNPROTECT(3);
+	return( sx_retval );
+#else
+	filename   = CHAR( STRING_ELT( sx_filename, 0 ));
+	varname    = CHAR( STRING_ELT( sx_varname, 0 ));
+	ndims      = length(sx_start);
+	isint      = INTEGER(sx_isint)[0];
+	byte_style = INTEGER(sx_byte_style)[0];
+	fixmiss    = INTEGER(sx_fixmiss)[0];
+	imvstate   = INTEGER(sx_imvstate)[0];
+	missval    = REAL(sx_missval)[0];
+	split      = INTEGER(sx_split)[0];
+	npieces    = length(sx_pstart);
+	if( (ndims < 1) || (ndims > MAX_NC_DIMS) || (split < 0) || (split >= ndims) || (npieces < 1)) {
+		Rprintf( "Error in R_nc4_get_vara_par: bad arguments\n" );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	n     = 1L;
+	inner = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		n *= s_count[i];
+		if( i > split )
+			inner *= s_count[i];
+		}
+	esize = isint ? sizeof(int) : sizeof(double);
+	nb    = (n > 0L) ? n*esize : 1L;
+
+	shared = (char *)mmap( NULL, nb, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( shared == (char *)MAP_FAILED ) {
+		Rprintf( "Error in R_nc4_get_vara_par: could not map %lu bytes of shared memory\n", (unsigned long)nb );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+	pids = (pid_t *)R_alloc( npieces, sizeof(pid_t) );
+
+	/* The I/O thread must be idle, not holding the library or the queue lock, when we fork */
+	R_ncu4_async_drain();
+
+	fflush( stdout );
+	fflush( stderr );
+	nfailed = 0;
+	for( ip=0; ip<npieces; ip++ ) {
+		pids[ip] = fork();
+		if( pids[ip] == 0 ) {
+			s_start[split] = R_ncu4_sizet_elt( sx_pstart, ip );
+			s_count[split] = R_ncu4_sizet_elt( sx_pcount, ip );
+			off = (s_start[split] - R_ncu4_sizet_elt( sx_start, split )) * inner * esize;
+			_exit( (R_ncu4_par_read_piece( filename, varname, ndims, s_start, s_count, isint, 
+				byte_style, fixmiss, imvstate, missval, shared + off ) == NC_NOERR) ? 0 : 1 );
+			}
+		if( pids[ip] < 0 )
+			nfailed++;
+		}
+
+	for( ip=0; ip<npieces; ip++ ) {
+		if( pids[ip] <= 0 )
+			continue;
+		if( R_ncu4_wait_child( pids[ip] ) != 0 )
+			nfailed++;
+		}
+
+	if( nfailed > 0 ) {
+		Rprintf( "Error in R_nc4_get_vara_par: %d of %d parts of the read failed\n", nfailed, npieces );
+		munmap( shared, nb );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	PROTECT( sx_data = allocVector( isint ? INTSXP : REALSXP, n ));
+	if( n > 0L )
+		memcpy( isint ? (void *)INTEGER(sx_data) : (void *)REAL(sx_data), shared, n*esize );
+	munmap( shared, nb );
+	SET_VECTOR_ELT( sx_retval, 1, sx_data );
+
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(4);
+	return( sx_retval );
+#endif
+}
+
+/*********************************************************************************
+ * Applies to n values read with nc_get_vara_int what ncvar_get_inner does to them: 
+ * the unsigned byte fix and, if fixmiss, setting the missing value (if hasmv) to NA.
+ */
+static void R_ncu4_fix_int( int *ip, size_t n, int precint, int byte_style, int fixmiss, 
+	int hasmv, double missval )
+{
+	size_t	k;
+
+	if( (precint == 6) && (byte_style == 2)) {
+		for( k=0L; k<n; k++ )
+			if( ip[k] < 0 )
+				ip[k] += 256;
+		}
+	if( fixmiss && hasmv ) {
+		for( k=0L; k<n; k++ )
+			if( (double)ip[k] == missval )
+				ip[k] = NA_INTEGER;
+		}
+}
+
+/*********************************************************************************
+ * As R_ncu4_fix_int, for n values read with nc_get_vara_double.  The missing value
+ * is matched exactly for integer types, and with the same tolerance as 
+ * ncvar_get_inner otherwise.  Scale and offset are applied if fixmiss.
+ */
+static void R_ncu4_fix_double( double *dp, size_t n, int precint, int byte_style, int fixmiss, 
+	int hasmv, double missval, double scale, double offset )
+{
+	size_t	k;
+	double	mvtol;
+
+	if( (precint == 6) && (byte_style == 2)) {
+		for( k=0L; k<n; k++ )
+			if( dp[k] < 0 )
+				dp[k] += 256;
+		}
+	if( ! fixmiss )
+		return;
+
+	if( hasmv ) {
+		mvtol = R_ncu4_mvtol( precint, missval );
+		for( k=0L; k<n; k++ )
+			if( R_ncu4_ismissval( dp[k], missval, mvtol ))
+				dp[k] = NA_REAL;
+		}
+	if( (scale != 1.0) || (offset != 0.0)) {
+		for( k=0L; k<n; k++ )
+			dp[k] = dp[k] * scale + offset;
+		}
+}
+
+/*********************************************************************************
+ * Fast path for ncvar_get, for small reads where the cost of the several calls made
+ * by the general path would be more than the read itself.  Everything that 
+ * ncvar_get_inner would ask the library for (type, shape, missing value, packing)
+ * is passed in, from the ncdf4 object.  This does the read and everything done to
+ * the values afterwards in one call, with the same results as ncvar_get_inner:
+ *	sx_precint	: the var's type code (as at the top of this file); char and
+ *			  string vars are not handled here
+ *	sx_start, sx_count : C order, 0-based
+ *	sx_byte_style	: 1 for signed bytes, 2 for unsigned
+ *	sx_fixmiss	: 0 to return the raw values (raw_datavals=TRUE), 1 otherwise
+ *	sx_missval	: the missing value; length 0 if none, or NA
+ *	sx_scale, sx_offset : the scale factor and offset to apply, if not 1 and 0
+ *	sx_dim		: the dim attribute to give the result, or NULL for none
+ * Returns the values, or NULL if anything went wrong; the caller then uses the
+ * general path, which reports the error.
+ */
+SEXP R_nc4_get_vara_fast( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, SEXP sx_scale, SEXP sx_offset, SEXP sx_dim )
+{
+	SEXP	sx_data, sx_ddata;
+	int	ncid, varid, precint, ndims, i, err, isint, fixmiss, hasmv, nprot, *ip;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], n, k;
+	double	missval, scale, offset, *dp;
+
+	ncid    = INTEGER(sx_ncid)[0];
+	varid   = INTEGER(sx_varid)[0];
+	precint = INTEGER(sx_precint)[0];
+	fixmiss = INTEGER(sx_fixmiss)[0];
+	scale   = REAL(sx_scale)[0];
+	offset  = REAL(sx_offset)[0];
+	ndims   = length(sx_start);
+	hasmv   = (length(sx_missval) == 1) && (! ISNAN(REAL(sx_missval)[0]));
+	missval = hasmv ? REAL(sx_missval)[0] : 0.0;
+
+	if( (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims))
+		return( R_NilValue );
+	if( (precint == 1) || (precint == 2) || (precint == 6) || (precint == 7) || (precint == 8))
+		isint = 1;
+	else if( (precint == 3) || (precint == 4) || (precint == 9) || (precint == 10) || (precint == 11))
+		isint = 0;
+	else
+		return( R_NilValue );
+
+	n = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		n *= s_count[i];
+		}
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	nprot = 1;
+	if( isint ) {
+		PROTECT( sx_data = allocVector( INTSXP, n ));
+		ip  = INTEGER(sx_data);
+		err = nc_get_vara_int( ncid, varid, s_start, s_count, ip );
+		if( err != NC_NOERR ) {
+			UNPROTECT(1);
+			return( R_NilValue );
+			}
+		R_ncu4_fix_int( ip, n, precint, INTEGER(sx_byte_style)[0], fixmiss, hasmv, missval );
+		if( fixmiss && ((scale != 1.0) || (offset != 0.0))) {
+			PROTECT( sx_ddata = allocVector( REALSXP, n ));
+			dp = REAL(sx_ddata);
+			for( k=0L; k<n; k++ )
+				dp[k] = ((ip[k] == NA_INTEGER) ? NA_REAL : (double)ip[k]) * scale + offset;
+			sx_data = sx_ddata;
+			nprot++;
+			}
+		}
+	else
+		{
+		PROTECT( sx_data = allocVector( REALSXP, n ));
+		dp  = REAL(sx_data);
+		err = nc_get_vara_double( ncid, varid, s_start, s_count, dp );
+		if( err != NC_NOERR ) {
+			UNPROTECT(1);
+			return( R_NilValue );
+			}
+		R_ncu4_fix_double( dp, n, precint, 1, fixmiss, hasmv, missval, scale, offset );
+		}
+
+	if( sx_dim != R_NilValue )
+		setAttrib( sx_data, R_DimSymbol, sx_dim );
+
+	UNPROTECT(nprot);
+	return( sx_data );
+}
+
+/*********************************************************************************
+ * Reads a hyperslab into part of an existing R vector rather than a newly allocated
+ * one, for ncvar_get_into.  The values are written to sx_buf starting at (0-based)
+ * element sx_boffset, and are fixed up in place as by R_nc4_get_vara_fast (the 
+ * arguments are the same).  sx_buf must be a double vector, or an integer vector 
+ * when the var is of an integer type and no scale or offset is applied.  Nothing 
+ * is allocated.  Returns sx_buf, or NULL if there was an error.
+ */
+SEXP R_nc4_get_vara_into( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_buf, SEXP sx_boffset, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset )
+{
+	int	ncid, varid, precint, ndims, i, err, fixmiss, hasmv, byte_style;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], n, boffset;
+	double	missval, scale, offset;
+
+	ncid       = INTEGER(sx_ncid)[0];
+	varid      = INTEGER(sx_varid)[0];
+	precint    = INTEGER(sx_precint)[0];
+	byte_style = INTEGER(sx_byte_style)[0];
+	fixmiss    = INTEGER(sx_fixmiss)[0];
+	scale      = REAL(sx_scale)[0];
+	offset     = REAL(sx_offset)[0];
+	boffset    = R_ncu4_sizet_elt( sx_boffset, 0 );
+	ndims      = length(sx_start);
+	hasmv      = (length(sx_missval) == 1) && (! ISNAN(REAL(sx_missval)[0]));
+	missval    = hasmv ? REAL(sx_missval)[0] : 0.0;
+
+	if( (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims)) {
+		Rprintf( "Error in R_nc4_get_vara_into: start and count must have the same length, and at most %d entries\n",
+			MAX_NC_DIMS );
+		return( R_NilValue );
+		}
+
+	n = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		n *= s_count[i];
+		}
+	if( boffset + n > (size_t)xlength(sx_buf) ) {
+		Rprintf( "Error in R_nc4_get_vara_into: %.0f values at offset %.0f do not fit in a buffer of length %.0f\n",
+			(double)n, (double)boffset, (double)xlength(sx_buf) );
+		return( R_NilValue );
+		}
+	if( n == 0L )
+		return( sx_buf );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	if( TYPEOF(sx_buf) == INTSXP ) {
+		if( ! ((precint == 1) || (precint == 2) || (precint == 6) || (precint == 7) || (precint == 8))) {
+			Rprintf( "Error in R_nc4_get_vara_into: an integer buffer can only be used for short, int, byte, ubyte and ushort vars\n" );
+			return( R_NilValue );
+			}
+		if( fixmiss && ((scale != 1.0) || (offset != 0.0))) {
+			Rprintf( "Error in R_nc4_get_vara_into: the values of this var are scaled or offset, so need a double buffer\n" );
+			return( R_NilValue );
+			}
+		err = nc_get_vara_int( ncid, varid, s_start, s_count, INTEGER(sx_buf) + boffset );
+		if( err == NC_NOERR )
+			R_ncu4_fix_int( INTEGER(sx_buf) + boffset, n, precint, byte_style, fixmiss, hasmv, missval );
+		}
+	else if( TYPEOF(sx_buf) == REALSXP ) {
+		if( (precint < 1) || (precint > 11) || (precint == 5)) {
+			Rprintf( "Error in R_nc4_get_vara_into: var must be of a numeric type\n" );
+			return( R_NilValue );
+			}
+		err = nc_get_vara_double( ncid, varid, s_start, s_count, REAL(sx_buf) + boffset );
+		if( err == NC_NOERR )
+			R_ncu4_fix_double( REAL(sx_buf) + boffset, n, precint, byte_style, fixmiss, hasmv, 
+				missval, scale, offset );
+		}
+	else
+		{
+		Rprintf( "Error in R_nc4_get_vara_into: the buffer must be a double or integer vector\n" );
+		return( R_NilValue );
+		}
+
+	if( err != NC_NOERR ) {
+		Rprintf( "Error in R_nc4_get_vara_into: %s\n", nc_strerror(err) );
+		return( R_NilValue );
+		}
+
+	return( sx_buf );
+}
+
+/*********************************************************************************
+ * Packs values and writes them to an integer var, for ncvar_put(..., pack=TRUE).
+ * Each value x is written as round((x - offset)/scale), clamped to the range of 
+ * the var's type (precint, as at the top of this file); NA is written as the 
+ * missing value.  If the missing value is at an end of the type's range, that
+ * end is moved in by one so a valid value is not written as missing.  Float and
+ * double vars get (x - offset)/scale, with no rounding or clamping.  sx_vals 
+ * (double or integer) is in R order; start and count are C order, 0-based.
+ *
+ * The values are packed and written a block at a time, so only a block's worth
+ * of packed values is ever held.  Blocks are contiguous runs of sx_vals: all of
+ * the fastest varying dims, part of one dim, and one index along the others.
+ *
+ * Returns a list with $error (0 if OK) and $nclip, the number of values clamped
+ * at the low and high ends of the range.
+ */
+SEXP R_nc4_put_vara_pack( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_vals, SEXP sx_scale, SEXP sx_offset, SEXP sx_missval )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_nclip;
+	int	ncid, varid, precint, ndims, i, d, err, isint, hasmv, *ivals, *ibuf;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], b_start[MAX_NC_DIMS], 
+		b_count[MAX_NC_DIMS], stride[MAX_NC_DIMS], n, nbuf, nb, k, voff;
+	double	scale, offset, missval, lo, hi, x, y, *dvals, *dbuf, nlo, nhi;
+	const size_t max_buf = 1048576L;
+
+	ncid    = INTEGER(sx_ncid)[0];
+	varid   = INTEGER(sx_varid)[0];
+	precint = INTEGER(sx_precint)[0];
+	scale   = REAL(sx_scale)[0];
+	offset  = REAL(sx_offset)[0];
+	ndims   = length(sx_start);
+	hasmv   = (length(sx_missval) == 1) && (! ISNAN(REAL(sx_missval)[0]));
+	missval = hasmv ? REAL(sx_missval)[0] : 0.0;
+	ivals   = (TYPEOF(sx_vals) == INTSXP) ? INTEGER(sx_vals) : NULL;
+	dvals   = (TYPEOF(sx_vals) == REALSXP) ? REAL(sx_vals) : NULL;
+
+	PROTECT( sx_retval = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("nclip") );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+	PROTECT( sx_nclip = allocVector( REALSXP, 2 ));
+	REAL(sx_nclip)[0] = REAL(sx_nclip)[1] = 0.0;
+	SET_VECTOR_ELT( sx_retval, 1, sx_nclip );
+
+	isint = 1;
+	switch( precint ) {
+		case 1:  lo = -32768.0;      hi = 32767.0;      break;
+		case 2:  lo = -2147483648.0; hi = 2147483647.0; break;
+		case 6:  lo = -128.0;        hi = 127.0;        break;
+		case 7:  lo = 0.0;           hi = 255.0;        break;
+		case 8:  lo = 0.0;           hi = 65535.0;      break;
+		case 9:  lo = 0.0;           hi = 4294967295.0;          isint = 0; break;
+		case 10: lo = -9.2233720368547758e18; hi = 9.2233720368547748e18; isint = 0; break;
+		case 11: lo = 0.0;           hi = 1.8446744073709550e19; isint = 0; break;
+		case 3:
+		case 4:  lo = -HUGE_VAL;     hi = HUGE_VAL;              isint = 0; break;
+		default:
+			Rprintf( "Error in R_nc4_put_vara_pack: can only pack values for a numeric var\n" );
+			UNPROTECT(3);
+			return( sx_retval );
+		}
+	if( hasmv && (missval == lo))
+		lo += 1.0;
+	if( hasmv && (missval == hi))
+		hi -= 1.0;
+	if( (scale == 0.0) || ISNAN(scale) || ISNAN(offset) || ((ivals == NULL) && (dvals == NULL)) || 
+	    (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims)) {
+		Rprintf( "Error in R_nc4_put_vara_pack: bad scale factor, offset, values, start or count\n" );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	/* Block shape: whole dims from the fastest varying in, then as much of 
+	 * the next one as fits in max_buf values
+	 */
+	n = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		n *= s_count[i];
+		}
+	if( (size_t)xlength(sx_vals) < n ) {
+		Rprintf( "Error in R_nc4_put_vara_pack: %.0f values to write, but only %.0f given\n", 
+			(double)n, (double)xlength(sx_vals) );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	/* With no missing value there is nothing to write NAs as.  Look for them before
+	 * any block is written, so that a failed call leaves the file as it was.
+	 */
+	if( ! hasmv ) {
+		for( k=0L; k<n; k++ )
+			if( (ivals != NULL) ? (ivals[k] == NA_INTEGER) : ISNAN(dvals[k]))
+				break;
+		if( k < n ) {
+			Rprintf( "Error in R_nc4_put_vara_pack: the values have NAs, but the var has no missing value\n" );
+			UNPROTECT(3);
+			return( sx_retval );
+			}
+		}
+	nbuf = 1L;
+	for( i=ndims-1; i>=0; i-- ) {
+		stride[i] = nbuf;
+		nbuf     *= s_count[i];
+		}
+	nb = 1L;
+	for( d=ndims-1; d>=0; d-- ) {
+		if( nb * s_count[d] > max_buf )
+			break;
+		nb *= s_count[d];
+		}
+	for( i=0; i<ndims; i++ ) {
+		if( i > d )
+			blk[i] = s_start[i] + s_count[i];	/* the whole of this dim */
+		else if( i == d ) {
+			blk[i] = max_buf / nb;			/* part of this dim */
+			if( blk[i] < 1L )
+				blk[i] = 1L;
+			}
+		else
+			blk[i] = 1L;
+		}
+	if( d >= 0 )
+		nb *= blk[d];
+	if( n == 0L ) {
+		INTEGER(sx_reterr)[0] = 0;
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	ibuf = isint ? (int    *)R_alloc( nb, sizeof(int)    ) : NULL;
+	dbuf = isint ? NULL : (double *)R_alloc( nb, sizeof(double) );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	nlo = nhi = 0.0;
+	R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+	do {
+		voff = 0L;
+		nb   = 1L;
+		for( i=0; i<ndims; i++ ) {
+			voff += (b_start[i] - s_start[i]) * stride[i];
+			nb   *= b_count[i];
+			}
+
+		for( k=0L; k<nb; k++ ) {
+			if( ivals != NULL )
+				x = (ivals[voff+k] == NA_INTEGER) ? NA_REAL : (double)ivals[voff+k];
+			else
+				x = dvals[voff+k];
+
+			if( ISNAN(x))
+				y = missval;		/* hasmv, checked above */
+			else
+				{
+				y = (x - offset) / scale;
+				if( isint || (precint > 4))
+					y = nearbyint( y );
+				if( y < lo ) {
+					y = lo;
+					nlo++;
+					}
+				else if( y > hi ) {
+					y = hi;
+					nhi++;
+					}
+				}
+			if( isint )
+				ibuf[k] = (int)y;
+			else
+				dbuf[k] = y;
+			}
+
+		if( isint )
+			err = nc_put_vara_int( ncid, varid, b_start, b_count, ibuf );
+		else
+			err = nc_put_vara_double( ncid, varid, b_start, b_count, dbuf );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_put_vara_pack: %s\n", nc_strerror( err ));
+			UNPROTECT(3);
+			return( sx_retval );
+			}
+		R_CheckUserInterrupt();
+		}
+	while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+
+	REAL(sx_nclip)[0] = nlo;
+	REAL(sx_nclip)[1] = nhi;
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(3);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Copies a block of values read from the file (buf, C order, shape b_count) to 
+ * where they go in a permuted output array.  ostr[i] is the output stride along C
+ * dim i; obase is where the block's first value goes.  Exactly one of dout and
+ * iout is not NULL.  Dim q is the one with output stride 1.  When q is not the
+ * fastest varying dim in buf, the two are copied in TILE x TILE tiles so that 
+ * both the reads and the writes stay in cache.
+ */
+#define R_NCU4_PERM_TILE 64
+static void R_ncu4_perm_block( int ndims, int q, size_t *b_count, size_t *ostr, size_t obase, 
+	double *buf, double *dout, int *iout )
+{
+	int	i, last;
+	size_t	bstr[MAX_NC_DIMS], pos[MAX_NC_DIMS], nrest, irest, ib, ob, a, b, a0, b0, a1, b1, ostr_b;
+
+	last = ndims - 1;
+	bstr[last] = 1L;
+	for( i=last-1; i>=0; i-- )
+		bstr[i] = bstr[i+1] * b_count[i+1];
+
+	nrest = 1L;
+	for( i=0; i<last; i++ ) {
+		pos[i] = 0L;
+		if( i != q )
+			nrest *= b_count[i];
+		}
+	ostr_b = ostr[last];
+
+	for( irest=0L; irest<nrest; irest++ ) {
+		ib = 0L;
+		ob = obase;
+		for( i=0; i<last; i++ ) {
+			ib += pos[i] * bstr[i];
+			ob += pos[i] * ostr[i];
+			}
+
+		if( q == last ) {
+			/* Rows are contiguous in the output as well */
+			if( dout != NULL )
+				memcpy( dout + ob, buf + ib, b_count[last]*sizeof(double) );
+			else
+				for( b=0L; b<b_count[last]; b++ )
+					iout[ob+b] = (int)buf[ib+b];
+			}
+		else
+			{
+			for( a0=0L; a0<b_count[q]; a0+=R_NCU4_PERM_TILE ) {
+				a1 = (a0 + R_NCU4_PERM_TILE < b_count[q]) ? a0 + R_NCU4_PERM_TILE : b_count[q];
+				for( b0=0L; b0<b_count[last]; b0+=R_NCU4_PERM_TILE ) {
+					b1 = (b0 + R_NCU4_PERM_TILE < b_count[last]) ? b0 + R_NCU4_PERM_TILE : b_count[last];
+					if( dout != NULL ) {
+						for( b=b0; b<b1; b++ )
+							for( a=a0; a<a1; a++ )
+								dout[ob + a + b*ostr_b] = buf[ib + a*bstr[q] + b];
+						}
+					else
+						{
+						for( b=b0; b<b1; b++ )
+							for( a=a0; a<a1; a++ )
+								iout[ob + a + b*ostr_b] = (int)buf[ib + a*bstr[q] + b];
+						}
+					}
+				}
+			}
+
+		/* Next combination of the other dims (not last or q) */
+		for( i=last-1; i>=0; i-- ) {
+			if( i == q )
+				continue;
+			if( ++pos[i] < b_count[i] )
+				break;
+			pos[i] = 0L;
+			}
+		}
+}
+
+/*********************************************************************************
+ * Reads a hyperslab with its dims permuted, for ncvar_get(..., perm=).  Rather
+ * than giving the output dims, the caller gives sx_ostr, the output stride along
+ * each (C order) dim of the var; exactly one must be 1.  The hyperslab is read in 
+ * blocks of shape sx_block (C order, as from ncvar_stream_block), and each block 
+ * is copied into place with R_ncu4_perm_block.  Then the values are fixed up as by
+ * R_nc4_get_vara_fast, whose other arguments these are.  The result is an integer 
+ * vector for integer vars with no scale or offset, and double otherwise.
+ *
+ * Returns a list with $error (0 if OK) and $data.
+ */
+SEXP R_nc4_get_vara_perm( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_ostr, SEXP sx_block, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_data;
+	int	ncid, varid, precint, ndims, i, q, err, isint, fixmiss, hasmv, *iout;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], b_start[MAX_NC_DIMS], 
+		b_count[MAX_NC_DIMS], ostr[MAX_NC_DIMS], n, nbuf, obase;
+	double	missval, scale, offset, *buf, *dout;
+
+	ncid    = INTEGER(sx_ncid)[0];
+	varid   = INTEGER(sx_varid)[0];
+	precint = INTEGER(sx_precint)[0];
+	fixmiss = INTEGER(sx_fixmiss)[0];
+	scale   = REAL(sx_scale)[0];
+	offset  = REAL(sx_offset)[0];
+	ndims   = length(sx_start);
+	hasmv   = (length(sx_missval) == 1) && (! ISNAN(REAL(sx_missval)[0]));
+	missval = hasmv ? REAL(sx_missval)[0] : 0.0;
+
+	PROTECT( sx_retval = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("data" ) );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	if( (precint < 1) || (precint > 11) || (precint == 5)) {
+		Rprintf( "Error in R_nc4_get_vara_perm: var must be of a numeric type\n" );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+	isint = ((precint == 1) || (precint == 2) || (precint == 6) || (precint == 7) || (precint == 8)) &&
+		(! (fixmiss && ((scale != 1.0) || (offset != 0.0))));
+
+	if( (ndims < 1) || (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims) || 
+	    (length(sx_ostr) != ndims) || (length(sx_block) != ndims)) {
+		Rprintf( "Error in R_nc4_get_vara_perm: start, count, ostr and block must all have one entry per dim\n" );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+	n    = 1L;
+	nbuf = 1L;
+	q    = -1;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		ostr[i]    = R_ncu4_sizet_elt( sx_ostr,  i );
+		blk[i]     = R_ncu4_sizet_elt( sx_block, i );
+		if( blk[i] < 1L        ) blk[i] = 1L;
+		if( blk[i] > s_count[i]) blk[i] = (s_count[i] > 0L) ? s_count[i] : 1L;
+		if( (ostr[i] == 1L) && (q == -1))
+			q = i;
+		n    *= s_count[i];
+		nbuf *= blk[i];
+		}
+	if( q == -1 ) {
+		Rprintf( "Error in R_nc4_get_vara_perm: no dim has an output stride of 1\n" );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	PROTECT( sx_data = allocVector( isint ? INTSXP : REALSXP, (R_xlen_t)n ));
+	SET_VECTOR_ELT( sx_retval, 1, sx_data );
+	iout = isint ? INTEGER(sx_data) : NULL;
+	dout = isint ? NULL : REAL(sx_data);
+	if( n == 0L ) {
+		INTEGER(sx_reterr)[0] = 0;
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+	buf = (double *)R_alloc( nbuf, sizeof(double) );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+	do {
+		err = nc_get_vara_double( ncid, varid, b_start, b_count, buf );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_get_vara_perm: %s\n", nc_strerror( err ));
+			UNPROTECT(3);
+			return( sx_retval );
+			}
+		obase = 0L;
+		for( i=0; i<ndims; i++ )
+			obase += (b_start[i] - s_start[i]) * ostr[i];
+		R_ncu4_perm_block( ndims, q, b_count, ostr, obase, buf, dout, iout );
+		R_CheckUserInterrupt();
+		}
+	while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+
+	if( isint )
+		R_ncu4_fix_int( iout, n, precint, INTEGER(sx_byte_style)[0], fixmiss, hasmv, missval );
+	else
+		R_ncu4_fix_double( dout, n, precint, INTEGER(sx_byte_style)[0], fixmiss, hasmv, missval, scale, offset );
+
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(3);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Reads only the cells picked out by a mask, for ncvar_get(..., mask=).  The mask
+ * covers the last sx_nmask dims of the hyperslab in C order (the first ones in R 
+ * order); sx_cells gives the picked cells as 0-based linear indices into those 
+ * dims of the hyperslab.  The other dims ("rest" dims, e.g. time) are read in 
+ * full.  The result is an ncells x (rest) array, with the cells in the order given.
+ *
+ * The hyperslab is stepped through in blocks of shape sx_block (C order; normally
+ * the chunk shape), and blocks that hold none of the picked cells are not read at
+ * all, so chunks that are wholly outside the mask are never decompressed.  To find
+ * the cells in a block quickly, the cells are first sorted by the block they fall
+ * in.  The values are fixed up as by R_nc4_get_vara_fast, whose other arguments 
+ * these are.  Returns a list with $error (0 if OK) and $data.
+ */
+SEXP R_nc4_get_vara_mask( SEXP sx_ncid, SEXP sx_varid, SEXP sx_precint, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_nmask, SEXP sx_cells, SEXP sx_block, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_data;
+	int	ncid, varid, precint, ndims, nmask, nr, i, err, isint, fixmiss, hasmv, *iout;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], blk[MAX_NC_DIMS], b_start[MAX_NC_DIMS], 
+		b_count[MAX_NC_DIMS], kb0[MAX_NC_DIMS], nkb[MAX_NC_DIMS], kstr[MAX_NC_DIMS], 
+		bstr[MAX_NC_DIMS], rstr[MAX_NC_DIMS], pos[MAX_NC_DIMS], ncells, ncellall, nrest, nkey, 
+		nbuf, n, j, t, lin, m, key, *ckey, *koff, *order, *cpos, nrestb, irest, boff, olin;
+	double	missval, scale, offset, *cells, *buf, *dout, v;
+
+	ncid    = INTEGER(sx_ncid)[0];
+	varid   = INTEGER(sx_varid)[0];
+	precint = INTEGER(sx_precint)[0];
+	nmask   = INTEGER(sx_nmask)[0];
+	fixmiss = INTEGER(sx_fixmiss)[0];
+	scale   = REAL(sx_scale)[0];
+	offset  = REAL(sx_offset)[0];
+	ndims   = length(sx_start);
+	nr      = ndims - nmask;
+	cells   = REAL(sx_cells);
+	ncells  = (size_t)xlength(sx_cells);
+	hasmv   = (length(sx_missval) == 1) && (! ISNAN(REAL(sx_missval)[0]));
+	missval = hasmv ? REAL(sx_missval)[0] : 0.0;
+
+	PROTECT( sx_retval = allocVector( VECSXP, 2 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 2 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("data" ) );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	UNPROTECT(1);
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+	if( (precint < 1) || (precint > 11) || (precint == 5)) {
+		Rprintf( "Error in R_nc4_get_vara_mask: var must be of a numeric type\n" );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+	isint = ((precint == 1) || (precint == 2) || (precint == 6) || (precint == 7) || (precint == 8)) &&
+		(! (fixmiss && ((scale != 1.0) || (offset != 0.0))));
+
+	if( (ndims < 1) || (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims) || (length(sx_block) != ndims) ||
+	    (nmask < 1) || (nmask > ndims)) {
+		Rprintf( "Error in R_nc4_get_vara_mask: bad start, count, block or number of mask dims\n" );
+		UNPROTECT(2);
+		return( sx_retval );
+		}
+
+	/* Blocks along the mask dims are numbered (key) in C order */
+	ncellall = 1L;
+	nrest    = 1L;
+	nbuf     = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start, i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count, i );
+		blk[i]     = R_ncu4_sizet_elt( sx_block, i );
+		if( blk[i] < 1L        ) blk[i] = 1L;
+		if( blk[i] > s_count[i]) blk[i] = (s_count[i] > 0L) ? s_count[i] : 1L;
+		nbuf *= blk[i];
+		if( i < nr )
+			nrest *= s_count[i];
+		else
+			ncellall *= s_count[i];
+		}
+	nkey = 1L;
+	for( i=ndims-1; i>=nr; i-- ) {
+		kb0[i]  = s_start[i] / blk[i];
+		nkb[i]  = (s_count[i] > 0L) ? (s_start[i] + s_count[i] - 1L) / blk[i] - kb0[i] + 1L : 1L;
+		kstr[i] = nkey;
+		nkey   *= nkb[i];
+		}
+	rstr[nr > 0 ? nr-1 : 0] = 1L;
+	for( i=nr-2; i>=0; i-- )
+		rstr[i] = rstr[i+1] * s_count[i+1];
+
+	for( j=0L; j<ncells; j++ ) {
+		v = cells[j];
+		if( ISNAN(v) || (v < 0.0) || (v >= (double)ncellall)) {
+			Rprintf( "Error in R_nc4_get_vara_mask: cell index %.0f is outside the %.0f cells of the mask dims\n",
+				v, (double)ncellall );
+			UNPROTECT(2);
+			return( sx_retval );
+			}
+		}
+
+	n = ncells * nrest;
+	PROTECT( sx_data = allocVector( isint ? INTSXP : REALSXP, (R_xlen_t)n ));
+	SET_VECTOR_ELT( sx_retval, 1, sx_data );
+	iout = isint ? INTEGER(sx_data) : NULL;
+	dout = isint ? NULL : REAL(sx_data);
+	if( n == 0L ) {
+		INTEGER(sx_reterr)[0] = 0;
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+
+	/* Sort the cells by the block they are in (a counting sort, so within a 
+	 * block they stay in increasing order of linear index if given that way)
+	 */
+	ckey  = (size_t *)R_alloc( ncells, sizeof(size_t) );
+	order = (size_t *)R_alloc( ncells, sizeof(size_t) );
+	cpos  = (size_t *)R_alloc( ncells, sizeof(size_t) );
+	koff  = (size_t *)R_alloc( nkey+1, sizeof(size_t) );
+	for( key=0L; key<=nkey; key++ )
+		koff[key] = 0L;
+	for( j=0L; j<ncells; j++ ) {
+		lin = (size_t)cells[j];
+		key = 0L;
+		for( i=ndims-1; i>=nr; i-- ) {
+			m    = lin % s_count[i];
+			lin /= s_count[i];
+			key += ((s_start[i] + m) / blk[i] - kb0[i]) * kstr[i];
+			}
+		ckey[j] = key;
+		koff[key+1]++;
+		}
+	for( key=0L; key<nkey; key++ )
+		koff[key+1] += koff[key];
+	for( j=0L; j<ncells; j++ )
+		order[ koff[ckey[j]]++ ] = j;
+	for( key=nkey; key>0L; key-- )		/* koff[key] is now the end of block key; shift back */
+		koff[key] = koff[key-1];
+	koff[0] = 0L;
+
+	buf = (double *)R_alloc( nbuf, sizeof(double) );
+
+	/* The library must not be in use by the I/O thread */
+	R_ncu4_async_drain();
+
+	R_ncu4_block_first( ndims, s_start, s_count, blk, b_start, b_count );
+	do {
+		key = 0L;
+		for( i=nr; i<ndims; i++ )
+			key += (b_start[i] / blk[i] - kb0[i]) * kstr[i];
+		if( koff[key] == koff[key+1] )
+			continue;	/* no picked cells in this block; skip it */
+
+		err = nc_get_vara_double( ncid, varid, b_start, b_count, buf );
+		if( err != NC_NOERR ) {
+			Rprintf( "Error in R_nc4_get_vara_mask: %s\n", nc_strerror( err ));
+			UNPROTECT(3);
+			return( sx_retval );
+			}
+
+		bstr[ndims-1] = 1L;
+		for( i=ndims-2; i>=0; i-- )
+			bstr[i] = bstr[i+1] * b_count[i+1];
+
+		/* Where each picked cell in this block is, within the block */
+		for( t=koff[key]; t<koff[key+1]; t++ ) {
+			lin = (size_t)cells[ order[t] ];
+			cpos[t] = 0L;
+			for( i=ndims-1; i>=nr; i-- ) {
+				m    = lin % s_count[i];
+				lin /= s_count[i];
+				cpos[t] += (s_start[i] + m - b_start[i]) * bstr[i];
+				}
+			}
+
+		nrestb = 1L;
+		for( i=0; i<nr; i++ ) {
+			nrestb *= b_count[i];
+			pos[i]  = 0L;
+			}
+		for( irest=0L; irest<nrestb; irest++ ) {
+			boff = 0L;
+			olin = 0L;
+			for( i=0; i<nr; i++ ) {
+				boff += pos[i] * bstr[i];
+				olin += (b_start[i] - s_start[i] + pos[i]) * rstr[i];
+				}
+			if( dout != NULL )
+				for( t=koff[key]; t<koff[key+1]; t++ )
+					dout[ order[t] + ncells*olin ] = buf[ boff + cpos[t] ];
+			else
+				for( t=koff[key]; t<koff[key+1]; t++ )
+					iout[ order[t] + ncells*olin ] = (int)buf[ boff + cpos[t] ];
+
+			for( i=nr-1; i>=0; i-- ) {
+				if( ++pos[i] < b_count[i] )
+					break;
+				pos[i] = 0L;
+				}
+			}
+		R_CheckUserInterrupt();
+		}
+	while( R_ncu4_block_next( ndims, s_start, s_count, blk, b_start, b_count ));
+
+	if( isint )
+		R_ncu4_fix_int( iout, n, precint, INTEGER(sx_byte_style)[0], fixmiss, hasmv, missval );
+	else
+		R_ncu4_fix_double( dout, n, precint, INTEGER(sx_byte_style)[0], fixmiss, hasmv, missval, scale, offset );
+
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(3);
+	return( sx_retval );
+}
+
+/*********************************************************************************
+ * Reads the same hyperslab of one var from each of several files (for example the
+ * members of an ensemble) into one array, with the members along the slowest 
+ * varying dim, for ncvar_get_stack.  The files are shared out among nworkers 
+ * forked worker processes; each opens its files itself (read only), checks that 
+ * the var has the shape given by sx_varsize (C order), and reads its member's 
+ * slice straight into its place in a shared anonymous mapping, which is copied
+ * into the result at the end.  The values are 
+ * fixed up as by R_nc4_get_vara_fast, whose other arguments these are, and are
+ * integer for integer vars with no scale or offset, and double otherwise.
+ *
+ * Returns a list with $error (0 if OK), $data, and $filestatus, which for each 
+ * file is 0 if it was read, 1 if the var's shape is different, 2 if the file or
+ * var could not be opened or read, and 3 if the worker did not finish.  Not 
+ * available on Windows.
+ */
+#ifndef _WIN32
+static int R_ncu4_stack_read_member( const char *filename, const char *varname, int ndims, 
+	size_t *varsize, size_t *s_start, size_t *s_count, int isint, void *out )
+{
+	int	ncid, gid, varid, vndims, i, status, dimids[MAX_NC_DIMS];
+	size_t	len;
+
+	if( nc_open( filename, NC_NOWRITE, &ncid ) != NC_NOERR )
+		return( 2 );
+	status = 0;
+	if( R_ncu4_varid_by_name( ncid, varname, &gid, &varid ) != NC_NOERR )
+		status = 2;
+	else if( (nc_inq_varndims( gid, varid, &vndims ) != NC_NOERR) || (vndims != ndims) ||
+		 (nc_inq_vardimid( gid, varid, dimids ) != NC_NOERR))
+		status = 1;
+	for( i=0; (status == 0) && (i<ndims); i++ )
+		if( (nc_inq_dimlen( gid, dimids[i], &len ) != NC_NOERR) || (len != varsize[i]))
+			status = 1;
+	if( status == 0 ) {
+		if( isint )
+			status = (nc_get_vara_int( gid, varid, s_start, s_count, (int *)out ) == NC_NOERR) ? 0 : 2;
+		else
+			status = (nc_get_vara_double( gid, varid, s_start, s_count, (double *)out ) == NC_NOERR) ? 0 : 2;
+		}
+	nc_close( ncid );
+
+	return( status );
+}
+#endif
+
+SEXP R_nc4_get_vara_stack( SEXP sx_filenames, SEXP sx_varname, SEXP sx_start, SEXP sx_count, 
+	SEXP sx_varsize, SEXP sx_precint, SEXP sx_byte_style, SEXP sx_fixmiss, SEXP sx_missval, 
+	SEXP sx_scale, SEXP sx_offset, SEXP sx_nworkers )
+{
+	SEXP	sx_retval, sx_retnames, sx_reterr, sx_data, sx_fstat;
+#ifndef _WIN32
+	int	ndims, precint, byte_style, fixmiss, hasmv, isint, nfiles, nworkers, iw, f, i, 
+		nfailed, *fstat;
+	size_t	s_start[MAX_NC_DIMS], s_count[MAX_NC_DIMS], varsize[MAX_NC_DIMS], n, nb, esize;
+	double	missval, scale, offset;
+	char	*shared;
+	void	*out;
+	pid_t	*pids;
+	const char *varname;
+#endif
+
+	PROTECT( sx_retval   = allocVector( VECSXP, 3 ));
+	PROTECT( sx_retnames = allocVector( STRSXP, 3 ));
+	SET_STRING_ELT( sx_retnames, 0, mkChar("error") );
+	SET_STRING_ELT( sx_retnames, 1, mkChar("data") );
+	SET_STRING_ELT( sx_retnames, 2, mkChar("filestatus") );
+	setAttrib( sx_retval, R_NamesSymbol, sx_retnames );
+	PROTECT( sx_reterr = allocVector( INTSXP, 1 ));
+	INTEGER(sx_reterr)[0] = -1;
+	SET_VECTOR_ELT( sx_retval, 0, sx_reterr );
+
+#ifdef _WIN32
+	Rprintf( "Error in R_nc4_get_vara_stack: parallel reads are not available on Windows\n" );
+	UNPROTECT(3);
+	return( sx_retval );
+#else
+	varname    = CHAR( STRING_ELT( sx_varname, 0 ));
+	nfiles     = length(sx_filenames);
+	ndims      = length(sx_start);
+	precint    = INTEGER(sx_precint)[0];
+	byte_style = INTEGER(sx_byte_style)[0];
+	fixmiss    = INTEGER(sx_fixmiss)[0];
+	scale      = REAL(sx_scale)[0];
+	offset     = REAL(sx_offset)[0];
+	nworkers   = INTEGER(sx_nworkers)[0];
+	hasmv      = (length(sx_missval) == 1) && (! ISNAN(REAL(sx_missval)[0]));
+	missval    = hasmv ? REAL(sx_missval)[0] : 0.0;
+	if( (ndims > MAX_NC_DIMS) || (length(sx_count) != ndims) || (length(sx_varsize) != ndims) || 
+	    (nfiles < 1) || (precint < 1) || (precint > 11) || (precint == 5)) {
+		Rprintf( "Error in R_nc4_get_vara_stack: bad arguments\n" );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+	if( nworkers > nfiles )
+		nworkers = nfiles;
+	if( nworkers < 1 )
+		nworkers = 1;
+	isint = ((precint == 1) || (precint == 2) || (precint == 6) || (precint == 7) || (precint == 8)) &&
+		(! (fixmiss && ((scale != 1.0) || (offset != 0.0))));
+
+	n = 1L;
+	for( i=0; i<ndims; i++ ) {
+		s_start[i] = R_ncu4_sizet_elt( sx_start,   i );
+		s_count[i] = R_ncu4_sizet_elt( sx_count,   i );
+		varsize[i] = R_ncu4_sizet_elt( sx_varsize, i );
+		n *= s_count[i];
+		}
+	esize = isint ? sizeof(int) : sizeof(double);
+	nb    = n*nfiles*esize + nfiles*sizeof(int);	/* the values, then each file's status */
+
+	shared = (char *)mmap( NULL, nb, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( shared == (char *)MAP_FAILED ) {
+		Rprintf( "Error in R_nc4_get_vara_stack: could not map %lu bytes of shared memory\n", (unsigned long)nb );
+		UNPROTECT(3);
+		return( sx_retval );
+		}
+	fstat = (int *)(shared + n*nfiles*esize);
+	for( f=0; f<nfiles; f++ )
+		fstat[f] = 3;
+	pids = (pid_t *)R_alloc( nworkers, sizeof(pid_t) );
+
+	/* Worker iw reads files iw, iw+nworkers, ... */
+	/* The I/O thread must be idle, not holding the library or the queue lock, when we fork */
+	R_ncu4_async_drain();
+
+	fflush( stdout );
+	fflush( stderr );
+	for( iw=0; iw<nworkers; iw++ ) {
+		pids[iw] = fork();
+		if( pids[iw] == 0 ) {
+			for( f=iw; f<nfiles; f+=nworkers ) {
+				out = shared + (size_t)f*n*esize;
+				fstat[f] = R_ncu4_stack_read_member( CHAR( STRING_ELT( sx_filenames, f )), varname, 
+					ndims, varsize, s_start, s_count, isint, out );
+				if( fstat[f] != 0 )
+					continue;
+				if( isint )
+					R_ncu4_fix_int( (int *)out, n, precint, byte_style, fixmiss, hasmv, missval );
+				else
+					R_ncu4_fix_double( (double *)out, n, precint, byte_style, fixmiss, hasmv, 
+						missval, scale, offset );
+				}
+			_exit( 0 );
+			}
+		}
+	for( iw=0; iw<nworkers; iw++ ) {
+		if( pids[iw] <= 0 )
+			continue;
+		R_ncu4_wait_child( pids[iw] );	/* how each file went is in fstat; a worker that died leaves 3 */
+		}
+
+	PROTECT( sx_fstat = allocVector( INTSXP, nfiles ));
+	nfailed = 0;
+	for( f=0; f<nfiles; f++ ) {
+		INTEGER(sx_fstat)[f] = fstat[f];
+		if( fstat[f] != 0 )
+			nfailed++;
+		}
+	SET_VECTOR_ELT( sx_retval, 2, sx_fstat );
+	if( nfailed > 0 ) {
+		Rprintf( "Error in R_nc4_get_vara_stack: %d of %d files could not be read\n", nfailed, nfiles );
+		munmap( shared, nb );
+		UNPROTECT(4);
+		return( sx_retval );
+		}
+
+	/* A forked worker cannot write into the parent's R heap (its pages are copy on
+	 * write), so the values come back through the shared mapping and are copied 
+	 * into the R vector once here.  This copy is a plain memcpy, small next to
+	 * the reads and decompression it lets run in parallel.
+	 */
+	PROTECT( sx_data = allocVector( isint ? INTSXP : REALSXP, (R_xlen_t)(n*nfiles) ));
+	if( n > 0L )
+		memcpy( isint ? (void *)INTEGER(sx_data) : (void *)REAL(sx_data), shared, n*nfiles*esize );
+	munmap( shared, nb );
+	SET_VECTOR_ELT( sx_retval, 1, sx_data );
+
+	INTEGER(sx_reterr)[0] = 0;
+	UNPROTECT(5);
+	return( sx_retval );
+#endif
+}